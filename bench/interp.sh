@@ -0,0 +1,39 @@
+#!/bin/bash
+# --interpと、アセンブリ出力+アセンブル+リンク+実行にかかる時間を比較する
+cd "$(dirname "$0")/.."
+
+runs=${RUNS:-5}
+
+# SCEVで畳み込めないよう、除算や条件分岐を含むループを使う
+programs=(
+    'return 42;'
+    'j=0; for (i=0; i<1000; i=i+1) j=j+i/3; return j;'
+    'j=0; for (i=0; i<1000000; i=i+1) j=j+i/3; return j;'
+    'j=0; for (i=0; i<3000; i=i+1) for (k=0; k<1000; k=k+1) if (k/7*7==k) j=j+1; return j;'
+)
+
+# コマンドをruns回実行した平均時間をミリ秒で出力する
+measure() {
+    local start end
+    start=$(date +%s%N)
+    for ((r = 0; r < runs; r++)); do
+        "$@" > /dev/null 2>&1
+    done
+    end=$(date +%s%N)
+    awk -v t=$((end - start)) -v n="$runs" 'BEGIN { printf "%.2f", t / n / 1000000 }'
+}
+
+build() {
+    ./orecc "$1" > tmp.bench.s && cc -o tmp.bench tmp.bench.s
+}
+
+printf "%10s %10s %10s %10s  %s\n" "build(ms)" "run(ms)" "total(ms)" "interp(ms)" "program"
+for p in "${programs[@]}"; do
+    b=$(measure build "$p")
+    build "$p" 2> /dev/null
+    n=$(measure ./tmp.bench)
+    i=$(measure ./orecc --interp "$p")
+    printf "%10s %10s %10s %10s  %s\n" "$b" "$n" "$(awk -v b="$b" -v n="$n" 'BEGIN { printf "%.2f", b + n }')" "$i" "$p"
+done
+
+rm -f tmp.bench tmp.bench.s
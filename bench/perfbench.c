@@ -0,0 +1,241 @@
+// 実行ファイルを繰り返し実行し、ハードウェアカウンタと経過時間の中央値をJSONの1オブジェクトとして出力する
+//
+// usage: perfbench <name> <opt> <runs> <program> [args...]
+//
+// カウンタはperf_event_openで子プロセスのユーザ空間だけを数える。
+// カウンタを使えない環境(仮想マシンやperf_event_paranoidの制限)では経過時間だけを出力する。
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief 計測するカウンタ。先頭のカウンタをグループのリーダーにして同時に数える
+ */
+static struct
+{
+    char *name;
+    uint64_t config;
+} events[] = {
+    {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+    {"branches", PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch_misses", PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+#define NEVENTS ((int)(sizeof(events) / sizeof(*events)))
+
+/**
+ * @brief 1回の実行の計測結果
+ */
+typedef struct
+{
+    uint64_t counts[NEVENTS];
+    uint64_t time_ns;
+    int status;
+} Sample;
+
+static void fail(char *msg)
+{
+    perror(msg);
+    exit(2);
+}
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid, int group_fd)
+{
+    return syscall(SYS_perf_event_open, attr, pid, -1, group_fd, 0);
+}
+
+/**
+ * @brief 子プロセスのカウンタを開く。子プロセスがexecした時点で数え始める
+ *
+ * @return すべてのカウンタを開けた場合true。開けなかった場合は開いたカウンタを閉じる
+ */
+static bool open_counters(pid_t pid, int *fds)
+{
+    for (int i = 0; i < NEVENTS; i++)
+    {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = i == 0;
+        attr.enable_on_exec = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = perf_event_open(&attr, pid, i == 0 ? -1 : fds[0]);
+        if (fds[i] < 0)
+        {
+            while (--i >= 0)
+            {
+                close(fds[i]);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief プログラムを1回実行して計測する
+ *
+ * @param use_counters カウンタを使う場合true。カウンタを開けなかった場合はfalseにする
+ */
+static Sample run_once(char **argv, bool *use_counters)
+{
+    // カウンタを開くまで子プロセスがexecしないよう、パイプで待たせる
+    int go[2];
+    if (pipe(go) < 0)
+    {
+        fail("pipe");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fail("fork");
+    }
+    if (pid == 0)
+    {
+        char c;
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1)
+        {
+            _exit(127);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(go[0]);
+
+    int fds[NEVENTS];
+    if (*use_counters && !open_counters(pid, fds))
+    {
+        fprintf(stderr, "perfbench: hardware counters unavailable (%s), measuring wall time only\n", strerror(errno));
+        *use_counters = false;
+    }
+
+    Sample s = {0};
+    uint64_t start = now_ns();
+    if (write(go[1], "x", 1) != 1)
+    {
+        fail("write");
+    }
+    close(go[1]);
+    if (waitpid(pid, &s.status, 0) < 0)
+    {
+        fail("waitpid");
+    }
+    s.time_ns = now_ns() - start;
+
+    if (*use_counters)
+    {
+        uint64_t buf[1 + NEVENTS];
+        if (read(fds[0], buf, sizeof(buf)) != sizeof(buf))
+        {
+            fail("read counters");
+        }
+        for (int i = 0; i < NEVENTS; i++)
+        {
+            s.counts[i] = buf[1 + i];
+            close(fds[i]);
+        }
+    }
+    return s;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a;
+    uint64_t y = *(uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief 各実行の値の中央値を求める。値の並びは並べ替える
+ */
+static uint64_t median(uint64_t *vals, int n)
+{
+    qsort(vals, n, sizeof(*vals), compare_u64);
+    return n % 2 ? vals[n / 2] : (vals[n / 2 - 1] + vals[n / 2]) / 2;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 5)
+    {
+        fprintf(stderr, "usage: %s <name> <opt> <runs> <program> [args...]\n", argv[0]);
+        return 2;
+    }
+
+    char *name = argv[1];
+    char *opt = argv[2];
+    int runs = atoi(argv[3]);
+    if (runs <= 0)
+    {
+        fprintf(stderr, "perfbench: invalid number of runs: %s\n", argv[3]);
+        return 2;
+    }
+
+    Sample *samples = calloc(runs, sizeof(Sample));
+    bool use_counters = !getenv("PERFBENCH_NO_COUNTERS");
+    for (int r = 0; r < runs; r++)
+    {
+        samples[r] = run_once(argv + 4, &use_counters);
+        if (samples[r].status != samples[0].status)
+        {
+            fprintf(stderr, "perfbench: %s %s: exit status differs between runs\n", name, opt);
+            return 1;
+        }
+    }
+
+    // 実行の途中でカウンタを使えなくなった場合、先の実行の値は捨てる
+    uint64_t *vals = calloc(runs, sizeof(uint64_t));
+    int status = samples[0].status;
+    printf("{\"name\": \"%s\", \"opt\": \"%s\", \"runs\": %d, ", name, opt, runs);
+    if (WIFEXITED(status))
+    {
+        printf("\"exit\": %d, ", WEXITSTATUS(status));
+    }
+    else
+    {
+        printf("\"signal\": %d, ", WTERMSIG(status));
+    }
+    for (int r = 0; r < runs; r++)
+    {
+        vals[r] = samples[r].time_ns;
+    }
+    printf("\"time_ns\": %llu", (unsigned long long)median(vals, runs));
+    if (use_counters)
+    {
+        for (int i = 0; i < NEVENTS; i++)
+        {
+            for (int r = 0; r < runs; r++)
+            {
+                vals[r] = samples[r].counts[i];
+            }
+            printf(", \"%s\": %llu", events[i].name, (unsigned long long)median(vals, runs));
+        }
+    }
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+# bench/programsのプログラムを各最適化レベルでコンパイルして実行し、計測結果をJSONで出力する。
+# 保存したベースラインがあれば比較し、遅くなったプログラムがあれば失敗する
+#
+# RUNS: 1つのプログラムを実行する回数 (既定値 5)
+# OUT: 計測結果の出力先 (既定値 bench/perf.json)
+# BASELINE: 比較するベースライン (既定値 bench/perf-baseline.json。空の場合は比較しない)
+cd "$(dirname "$0")/.."
+
+runs=${RUNS:-5}
+out=${OUT:-bench/perf.json}
+baseline=${BASELINE-bench/perf-baseline.json}
+opts=(-O0 -O1 -O2)
+
+records=()
+for f in bench/programs/*.orecc; do
+    name=$(basename "$f" .orecc)
+    for opt in "${opts[@]}"; do
+        if ! ./orecc "$opt" -f "$f" > tmp.perf.s || ! cc -o tmp.perf tmp.perf.s 2> /dev/null; then
+            echo "perfbench: failed to build $name $opt" >&2
+            exit 1
+        fi
+        record=$(./bench/perfbench "$name" "$opt" "$runs" ./tmp.perf) || exit 1
+        echo "$record" >&2
+        records+=("$record")
+    done
+done
+rm -f tmp.perf tmp.perf.s
+
+# 1行に1つの結果を置いたJSONの配列にする。perfcmp.shはこの形を前提に読む
+{
+    echo "["
+    for ((i = 0; i < ${#records[@]}; i++)); do
+        sep=$([ $((i + 1)) -lt ${#records[@]} ] && echo ",")
+        echo "  ${records[$i]}$sep"
+    done
+    echo "]"
+} > "$out"
+echo "perfbench: results written to $out" >&2
+
+if [ -n "$baseline" ] && [ -f "$baseline" ]; then
+    ./bench/perfcmp.sh "$baseline" "$out"
+fi
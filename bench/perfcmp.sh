@@ -0,0 +1,63 @@
+#!/bin/bash
+# perfbench.shの2つの計測結果を比較し、ベースラインより遅くなったプログラムを報告する。
+# サイクル数を計測できた結果どうしはサイクル数で、そうでなければ経過時間で比べる
+#
+# usage: perfcmp.sh <baseline.json> <result.json> [threshold(%)]
+# THRESHOLD(既定値 5)%を超えて遅くなったか、終了コードが変わった場合は1で終了する
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <baseline.json> <result.json> [threshold(%)]" >&2
+    exit 2
+fi
+
+awk -v threshold="${3:-${THRESHOLD:-5}}" '
+BEGIN {
+    printf "%-24s %-6s %14s %14s %8s  %s\n", "program", "opt", "baseline", "result", "change", "metric"
+}
+
+# 1行のJSONオブジェクトから数値またはキーの値を取り出す
+function field(line, key,    m) {
+    if (match(line, "\"" key "\": \"?[^,\"}]*")) {
+        m = substr(line, RSTART, RLENGTH)
+        sub(/^"[^"]*": "?/, "", m)
+        return m
+    }
+    return ""
+}
+
+/"name"/ {
+    key = field($0, "name") " " field($0, "opt")
+    status = field($0, "exit") != "" ? "exit " field($0, "exit") : "signal " field($0, "signal")
+    if (FILENAME == ARGV[1]) {
+        base_cycles[key] = field($0, "cycles")
+        base_time[key] = field($0, "time_ns")
+        base_status[key] = status
+        next
+    }
+
+    if (!(key in base_time)) {
+        printf "%-24s %-6s %14s %14s %8s  new\n", field($0, "name"), field($0, "opt"), "-", "-", "-"
+        next
+    }
+
+    if (base_cycles[key] != "" && field($0, "cycles") != "") {
+        metric = "cycles"; old = base_cycles[key]; cur = field($0, "cycles")
+    } else {
+        metric = "time_ns"; old = base_time[key]; cur = field($0, "time_ns")
+    }
+    change = old > 0 ? (cur - old) * 100 / old : 0
+
+    note = ""
+    if (status != base_status[key]) {
+        note = "  CHANGED (" base_status[key] " -> " status ")"
+        failed = 1
+    } else if (change > threshold) {
+        note = "  REGRESSION"
+        failed = 1
+    }
+    printf "%-24s %-6s %14s %14s %+7.1f%%  %s%s\n", field($0, "name"), field($0, "opt"), old, cur, change, metric, note
+}
+
+END {
+    exit failed
+}
+' "$1" "$2"
@@ -3,6 +3,19 @@
 static int top;
 static int labelseq = 1;
 
+// 出力中の関数のreturnの飛び先のラベルの番号
+static int return_seq;
+
+// 関数呼び出しのためにフレームより下に積んだ値の数。呼び出し時にrspを16バイト境界に揃えるために使う
+static int depth;
+
+// 引数を渡すレジスタ
+static char *argreg[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+// 最後に出力した.locディレクティブの行番号と桁番号
+static int last_line;
+static int last_col;
+
 /**
  * @brief 指定した番号のレジスタの名前を求める
  *
@@ -19,101 +32,646 @@ static char *reg(int idx)
     return r[idx];
 }
 
-static void gen_addr(Node *node)
+// 命令のコスト。cmp + setcc + movzbのように複数の命令で実現する演算は合計で数える
+#define COST_MOV_IMM 1
+#define COST_LOAD 1
+#define COST_STORE 1
+#define COST_CALL 5
+
+/**
+ * @brief 演算のオペランドの形式
+ */
+typedef enum
 {
-    if (node->kind == ND_VAR)
+    FORM_REG, // レジスタ
+    FORM_IMM, // 32ビットに収まる即値
+    FORM_MEM, // ローカル変数のメモリ参照 qword ptr [rbp-offset]
+} Form;
+
+/**
+ * @brief 演算を実現する命令のコスト。-1はその形式の命令がないことを表す
+ */
+typedef struct
+{
+    NodeKind kind;
+
+    /**
+     * @brief オペランドを入れ替えて評価できる場合true。比較は条件を反転して入れ替える
+     */
+    bool swappable;
+
+    int rr; // op reg, reg
+    int ri; // op reg, imm
+    int rm; // op reg, [mem]
+    int mi; // op reg, [mem], imm
+} OpCost;
+
+static OpCost op_costs[] = {
+    {ND_ADD, true, 1, 1, 1, -1},
+    {ND_SUB, false, 1, 1, 1, -1},
+    {ND_MUL, true, 3, 3, 3, 3},  // imul reg, reg / imul reg, reg, imm / imul reg, [mem], imm
+    {ND_DIV, false, 30, 30, 30, -1}, // mov rax + cqo + idiv + mov。即値はrcxに移してから割る
+    {ND_UDIV, false, 25, 25, 25, -1}, // mov rax + xor edx + div + mov。符号拡張がなく、divはidivより速い
+    {ND_SHR, false, 2, 1, -1, -1}, // shr reg, imm。シフト量がレジスタの場合はclに移す
+    {ND_EQ, true, 3, 3, 3, -1},  // cmp + sete + movzb
+    {ND_NE, true, 3, 3, 3, -1},
+    {ND_LT, true, 3, 3, 3, -1},
+    {ND_LE, true, 3, 3, 3, -1},
+};
+
+/**
+ * @brief 式のノードを覆うタイル。ノードの値をレジスタに求める最小のコストと、そのときの命令の形
+ */
+typedef struct
+{
+    int cost;
+    bool swap; // 右辺を先に評価し、演算の左オペランドにする
+    Form lhs;
+    Form rhs;
+} Tile;
+
+// ノードのインデックスを添字とするタイルの表。costが0のノードはまだタイルを選んでいない
+static Tile *tiles;
+
+static OpCost *find_op_cost(NodeKind kind)
+{
+    for (int i = 0; i < sizeof(op_costs) / sizeof(*op_costs); i++)
     {
-        // lea dst [src]
-        // [src] (アドレス値)を dst レジスタにストアする
-        printf("    lea %s, [rbp-%d]\n", reg(top++), node->var->offset);
-        return;
+        if (op_costs[i].kind == kind)
+        {
+            return &op_costs[i];
+        }
+    }
+    error("invalid expression");
+    return NULL;
+}
+
+static bool is_imm(NodeId id)
+{
+    Node *node = nd(id);
+    return node->kind == ND_NUM && INT_MIN <= node->val && node->val <= INT_MAX;
+}
+
+static bool is_mem(NodeId id)
+{
+    return nd(id)->kind == ND_VAR;
+}
+
+/**
+ * @brief 二項演算の左辺と右辺の評価順を入れ替えてよいか判定する
+ */
+static bool can_swap(Node *node)
+{
+    if (nd(node->lhs)->kind == ND_NUM)
+    {
+        return true;
+    }
+    return is_pure(node->lhs) && is_pure(node->rhs);
+}
+
+static void try_tile(Tile *best, int cost, bool swap, Form lhs, Form rhs)
+{
+    if (cost < best->cost)
+    {
+        *best = (Tile){cost, swap, lhs, rhs};
+    }
+}
+
+/**
+ * @brief 式の木を、コストの合計が最小になるタイルで覆う
+ *
+ * @param id 式のノード
+ * @return 値をレジスタに求めるコスト
+ */
+static int label(NodeId id)
+{
+    Node *node = nd(id);
+    Tile *t = &tiles[id];
+    switch (node->kind)
+    {
+    case ND_NUM:
+        *t = (Tile){COST_MOV_IMM};
+        return t->cost;
+    case ND_VAR:
+        *t = (Tile){COST_LOAD};
+        return t->cost;
+    case ND_ASSIGN:
+        *t = (Tile){label(node->rhs) + COST_STORE};
+        return t->cost;
+    case ND_FUNCALL:
+        // 引数はそれぞれ評価してから渡すため、呼び出し全体を1つのタイルで覆う
+        *t = (Tile){COST_CALL};
+        return t->cost;
+    case ND_SELECT:
+        // 条件の比較とcmovは分岐と同じく1命令ずつで数える
+        *t = (Tile){label(node->cond) + label(node->then) + label(node->els) + 1};
+        return t->cost;
+    default:
+        break;
+    }
+
+    OpCost *c = find_op_cost(node->kind);
+    int cost[2] = {label(node->lhs), label(node->rhs)};
+    Tile best = {INT_MAX};
+
+    for (int swap = 0; swap < 2; swap++)
+    {
+        if (swap && !(c->swappable && can_swap(node)))
+        {
+            continue;
+        }
+        NodeId a = swap ? node->rhs : node->lhs;
+        NodeId b = swap ? node->lhs : node->rhs;
+        int ac = cost[swap];
+        int bc = cost[!swap];
+
+        try_tile(&best, ac + bc + c->rr, swap, FORM_REG, FORM_REG);
+        if (c->ri >= 0 && is_imm(b))
+        {
+            try_tile(&best, ac + c->ri, swap, FORM_REG, FORM_IMM);
+        }
+        if (c->rm >= 0 && is_mem(b))
+        {
+            try_tile(&best, ac + c->rm, swap, FORM_REG, FORM_MEM);
+        }
+        if (c->mi >= 0 && is_mem(a) && is_imm(b))
+        {
+            try_tile(&best, c->mi, swap, FORM_MEM, FORM_IMM);
+        }
+    }
+
+    *t = best;
+    return t->cost;
+}
+
+static Tile *tile_of(NodeId id)
+{
+    if (!tiles[id].cost)
+    {
+        label(id);
+    }
+    return &tiles[id];
+}
+
+static int var_offset(NodeId id)
+{
+    return nd(id)->var->offset;
+}
+
+static void gen_expr(NodeId id);
+static char *gen_cond(NodeId id, bool when);
+
+/**
+ * @brief 演算の右オペランドを用意し、命令に書く文字列を求める。
+ * FORM_REGの場合は値をレジスタに求めるため、演算後にtopを1つ戻す必要がある
+ */
+static char *gen_operand(NodeId id, Form form, char *buf, int len)
+{
+    switch (form)
+    {
+    case FORM_IMM:
+        snprintf(buf, len, "%ld", nd(id)->val);
+        return buf;
+    case FORM_MEM:
+        snprintf(buf, len, "qword ptr [rbp-%d]", var_offset(id));
+        return buf;
+    default:
+        gen_expr(id);
+        return reg(top - 1);
+    }
+}
+
+/**
+ * @brief 比較演算に対応する条件コードを求める
+ *
+ * @param kind 比較演算の種類
+ * @param swap オペランドを入れ替えて比較する場合true
+ * @param negate 条件を否定する場合true
+ */
+static char *cond_code(NodeKind kind, bool swap, bool negate)
+{
+    switch (kind)
+    {
+    case ND_EQ:
+        return negate ? "ne" : "e";
+    case ND_NE:
+        return negate ? "e" : "ne";
+    case ND_LT:
+        // a < b は b > a
+        if (swap)
+        {
+            return negate ? "le" : "g";
+        }
+        return negate ? "ge" : "l";
+    case ND_LE:
+        if (swap)
+        {
+            return negate ? "l" : "ge";
+        }
+        return negate ? "g" : "le";
+    default:
+        error("invalid comparison");
+        return NULL;
     }
+}
 
-    error("not an lvalue");
+/**
+ * @brief 関数のシンボル名の接頭辞。レジスタ名などと重ならないよう、main以外は接頭辞を付けたローカルなシンボルにする
+ */
+static char *sym_prefix(Function *fn)
+{
+    return strcmp(fn->name, "main") ? "orecc." : "";
 }
 
-static void load(void)
+/**
+ * @brief 関数を呼び出し、戻り値をレジスタスタックに積む
+ */
+static void gen_funcall(Node *node)
 {
-    printf("    mov %s, [%s]\n", reg(top - 1), reg(top - 1));
+    // r10, r11は呼び出し先で壊れうる。呼び出しを入れ子にしてもレジスタが足りるよう、
+    // 評価中の値をすべてスタックに退避し、引数は空のレジスタスタックで評価する
+    int nsave = top;
+    for (int i = 0; i < nsave; i++)
+    {
+        printf("    push %s\n", reg(i));
+        depth++;
+    }
+    top = 0;
+
+    NodeId args[6];
+    int nargs = 0;
+    bool pure = true;
+    for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+    {
+        args[nargs++] = arg;
+        pure = pure && is_pure(arg);
+    }
+
+    // 引数を評価してスタックに積み、最後に評価した引数だけ直接レジスタに移す。
+    // どの引数にも副作用がない場合、変数と即値は評価順によらないため最後にレジスタへ直接読み込む
+    bool direct[6];
+    int last = -1;
+    for (int i = 0; i < nargs; i++)
+    {
+        direct[i] = pure && (is_imm(args[i]) || is_mem(args[i]));
+        if (!direct[i])
+        {
+            last = i;
+        }
+    }
+    for (int i = 0; i < nargs; i++)
+    {
+        if (direct[i])
+        {
+            continue;
+        }
+        gen_expr(args[i]);
+        if (i == last)
+        {
+            printf("    mov %s, %s\n", argreg[i], reg(--top));
+        }
+        else
+        {
+            printf("    push %s\n", reg(--top));
+            depth++;
+        }
+    }
+    for (int i = last - 1; i >= 0; i--)
+    {
+        if (!direct[i])
+        {
+            printf("    pop %s\n", argreg[i]);
+            depth--;
+        }
+    }
+    for (int i = 0; i < nargs; i++)
+    {
+        if (direct[i] && is_imm(args[i]))
+        {
+            printf("    mov %s, %ld\n", argreg[i], nd(args[i])->val);
+        }
+        else if (direct[i])
+        {
+            printf("    mov %s, qword ptr [rbp-%d]\n", argreg[i], var_offset(args[i]));
+        }
+    }
+
+    if (depth % 2)
+    {
+        printf("    sub rsp, 8\n");
+    }
+    printf("    call %s%s\n", sym_prefix(node->func), node->func->name);
+    if (depth % 2)
+    {
+        printf("    add rsp, 8\n");
+    }
+
+    top = nsave;
+    for (int i = nsave - 1; i >= 0; i--)
+    {
+        printf("    pop %s\n", reg(i));
+        depth--;
+    }
+    printf("    mov %s, rax\n", reg(top++));
 }
 
-static void store(void)
+static bool is_comparison(NodeKind kind)
 {
-    // スタックトップをアドレスした変数にスタックトップから2番目の値を格納する
-    // ND_ASSIGNでlhs, rhsを生成したあとに実行している
-    printf("    mov [%s], %s\n", reg(top - 1), reg(top - 2));
-    top--;
+    return kind == ND_EQ || kind == ND_NE || kind == ND_LT || kind == ND_LE;
 }
 
-static void gen_expr(Node *node)
+static void gen_expr(NodeId id)
 {
+    Node *node = nd(id);
     switch (node->kind)
     {
     case ND_NUM:
         printf("    mov %s, %lu\n", reg(top++), node->val);
         return;
     case ND_VAR:
-        gen_addr(node); // 変数のアドレスを算出
-        load();         // スタックトップの値をアドレスとした変数から値を取得してスタックトップにpush
+        printf("    mov %s, qword ptr [rbp-%d]\n", reg(top++), node->var->offset);
         return;
     case ND_ASSIGN:
+        assert(nd(node->lhs)->kind == ND_VAR);
         gen_expr(node->rhs);
-        gen_addr(node->lhs);
-        store();
+        printf("    mov qword ptr [rbp-%d], %s\n", var_offset(node->lhs), reg(top - 1));
+        return;
+    case ND_FUNCALL:
+        gen_funcall(node);
+        return;
+    case ND_SELECT:
+    {
+        // 両方の値を求めてから比較し、条件が成り立てばthenの値で置き換える
+        gen_expr(node->els);
+        gen_expr(node->then);
+        char *cc = gen_cond(node->cond, true);
+        printf("    cmov%s %s, %s\n", cc, reg(top - 2), reg(top - 1));
+        top--;
         return;
     }
+    default:
+        break;
+    }
 
-    gen_expr(node->lhs);
-    gen_expr(node->rhs);
+    Tile *t = tile_of(id);
+    NodeId a = t->swap ? node->rhs : node->lhs;
+    NodeId b = t->swap ? node->lhs : node->rhs;
 
-    char *rd = reg(top - 2);
-    char *rs = reg(top - 1);
-    top--;
+    // imul reg, [mem], imm
+    if (t->lhs == FORM_MEM)
+    {
+        printf("    imul %s, qword ptr [rbp-%d], %ld\n", reg(top++), var_offset(a), nd(b)->val);
+        return;
+    }
+
+    gen_expr(a);
+    char *rd = reg(top - 1);
+    char buf[32];
+    char *rs = gen_operand(b, t->rhs, buf, sizeof(buf));
 
     switch (node->kind)
     {
     case ND_ADD:
         printf("    add %s, %s\n", rd, rs);
-        return;
+        break;
     case ND_SUB:
         printf("    sub %s, %s\n", rd, rs);
-        return;
+        break;
     case ND_MUL:
-        printf("    imul %s, %s\n", rd, rs);
-        return;
+        if (t->rhs == FORM_IMM)
+        {
+            printf("    imul %s, %s, %s\n", rd, rd, rs);
+        }
+        else
+        {
+            printf("    imul %s, %s\n", rd, rs);
+        }
+        break;
     case ND_DIV:
         printf("    mov rax, %s\n", rd);
         printf("    cqo\n");
-        printf("    idiv %s\n", rs);
+        if (t->rhs == FORM_IMM)
+        {
+            printf("    mov rcx, %s\n", rs);
+            printf("    idiv rcx\n");
+        }
+        else
+        {
+            printf("    idiv %s\n", rs);
+        }
         printf("    mov %s, rax\n", rd);
-        return;
-    case ND_EQ:
+        break;
+    case ND_UDIV:
+        printf("    mov rax, %s\n", rd);
+        printf("    xor edx, edx\n");
+        if (t->rhs == FORM_IMM)
+        {
+            printf("    mov rcx, %s\n", rs);
+            printf("    div rcx\n");
+        }
+        else
+        {
+            printf("    div %s\n", rs);
+        }
+        printf("    mov %s, rax\n", rd);
+        break;
+    case ND_SHR:
+        if (t->rhs == FORM_IMM)
+        {
+            printf("    shr %s, %s\n", rd, rs);
+        }
+        else
+        {
+            printf("    mov rcx, %s\n", rs);
+            printf("    shr %s, cl\n", rd);
+        }
+        break;
+    default:
         printf("    cmp %s, %s\n", rd, rs);
-        printf("    sete al\n");
+        printf("    set%s al\n", cond_code(node->kind, t->swap, false));
         printf("    movzb %s, al\n", rd);
+        break;
+    }
+
+    if (t->rhs == FORM_REG)
+    {
+        top--;
+    }
+}
+
+/**
+ * @brief 条件式を評価してフラグを設定するコードを出力する。比較演算は値を求めずに比較だけを行う
+ *
+ * @param id 条件式のノード
+ * @param when 条件コードが成り立つ条件式の真偽
+ * @return 条件コード
+ */
+static char *gen_cond(NodeId id, bool when)
+{
+    Node *node = nd(id);
+
+    if (is_comparison(node->kind))
+    {
+        Tile *t = tile_of(id);
+        NodeId a = t->swap ? node->rhs : node->lhs;
+        NodeId b = t->swap ? node->lhs : node->rhs;
+        gen_expr(a);
+        char buf[32];
+        char *rs = gen_operand(b, t->rhs, buf, sizeof(buf));
+        printf("    cmp %s, %s\n", reg(top - 1 - (t->rhs == FORM_REG)), rs);
+        top -= 1 + (t->rhs == FORM_REG);
+        return cond_code(node->kind, t->swap, !when);
+    }
+
+    if (node->kind == ND_VAR)
+    {
+        printf("    cmp qword ptr [rbp-%d], 0\n", node->var->offset);
+    }
+    else
+    {
+        gen_expr(id);
+        printf("    test %s, %s\n", reg(top - 1), reg(top - 1));
+        top--;
+    }
+    return when ? "ne" : "e";
+}
+
+/**
+ * @brief 条件式の値に応じて分岐するコードを出力する。比較演算は比較と分岐を直接つなげる
+ *
+ * @param id 条件式のノード
+ * @param when 分岐する条件式の真偽
+ * @param label 分岐先のラベル
+ * @param seq 分岐先のラベルの番号
+ */
+static void gen_branch(NodeId id, bool when, char *label, int seq)
+{
+    char *cc = gen_cond(id, when);
+    printf("    j%s %s.%d\n", cc, label, seq);
+}
+
+/**
+ * @brief 値を使わない式のコードを出力する。変数への代入は即値やメモリオペランドの命令で直接行う
+ */
+static void gen_void_expr(NodeId id)
+{
+    Node *node = nd(id);
+    if (node->kind != ND_ASSIGN)
+    {
+        gen_expr(id);
+        top--;
         return;
-    case ND_NE:
-        printf("    cmp %s, %s\n", rd, rs);
-        printf("    setne al\n");
-        printf("    movzb %s, al\n", rd);
+    }
+
+    Var *var = nd(node->lhs)->var;
+    Node *rhs = nd(node->rhs);
+
+    // mov qword ptr [mem], imm
+    if (is_imm(node->rhs))
+    {
+        printf("    mov qword ptr [rbp-%d], %ld\n", var->offset, rhs->val);
         return;
-    case ND_LT:
-        printf("    cmp %s, %s\n", rd, rs);
-        printf("    setl al\n");
-        printf("    movzb %s, al\n", rd);
+    }
+
+    // v = v + x, v = x + v, v = v - x: add qword ptr [mem], x
+    if (rhs->kind == ND_ADD || rhs->kind == ND_SUB)
+    {
+        NodeId x = 0;
+        if (nd(rhs->lhs)->kind == ND_VAR && nd(rhs->lhs)->var == var)
+        {
+            x = rhs->rhs;
+        }
+        else if (rhs->kind == ND_ADD && nd(rhs->rhs)->kind == ND_VAR && nd(rhs->rhs)->var == var &&
+                 (nd(rhs->lhs)->kind == ND_NUM || is_pure(rhs->lhs)))
+        {
+            x = rhs->lhs;
+        }
+
+        // xを先に評価するため、xがvに代入しない場合に限る
+        if (x && !is_assigned(x, var))
+        {
+            char *op = rhs->kind == ND_ADD ? "add" : "sub";
+            if (is_imm(x))
+            {
+                printf("    %s qword ptr [rbp-%d], %ld\n", op, var->offset, nd(x)->val);
+                return;
+            }
+            gen_expr(x);
+            printf("    %s qword ptr [rbp-%d], %s\n", op, var->offset, reg(--top));
+            return;
+        }
+    }
+
+    gen_expr(node->rhs);
+    printf("    mov qword ptr [rbp-%d], %s\n", var->offset, reg(--top));
+}
+
+/**
+ * @brief 以降の命令に対応するソースコード上の位置を.locディレクティブで出力する
+ *
+ * @param loc ソースコード上の位置
+ */
+static void gen_loc(int loc)
+{
+    if (!opt_g)
+    {
         return;
-    case ND_LE:
-        printf("    cmp %s, %s\n", rd, rs);
-        printf("    setle al\n");
-        printf("    movzb %s, al\n", rd);
+    }
+
+    int line, col;
+    get_line_col(loc, &line, &col);
+    if (line == last_line && col == last_col)
+    {
         return;
-    default:
-        error("invalid expression");
     }
+    printf("    .loc 1 %d %d\n", line, col);
+    last_line = line;
+    last_col = col;
 }
 
-static void gen_stmt(Node *node)
+/**
+ * @brief 式の先頭の位置を求める。二項演算子のノードの位置は演算子の位置のため、左辺をたどる
+ */
+static int expr_loc(NodeId id)
+{
+    Node *node = nd(id);
+    while (node->kind != ND_NUM && node->kind != ND_VAR && node->kind != ND_FUNCALL && node->kind != ND_SELECT)
+    {
+        node = nd(node->lhs);
+    }
+    return node->loc;
+}
+
+/**
+ * @brief 後続の文の位置を求める。後続の文がない場合はノード自身の位置
+ */
+static int next_loc(Node *node)
 {
+    return node->next ? nd(node->next)->loc : node->loc;
+}
+
+/**
+ * @brief ループの先頭をopt_align_loopsバイト境界に揃えるディレクティブを出力する
+ */
+static void gen_loop_align(void)
+{
+    if (opt_align_loops <= 1)
+    {
+        return;
+    }
+
+    int log2 = 0;
+    while ((1 << log2) < opt_align_loops)
+    {
+        log2++;
+    }
+    printf("    .p2align %d,,%d\n", log2, opt_align_loops_skip);
+}
+
+static void gen_stmt(NodeId id)
+{
+    Node *node = nd(id);
+    gen_loc(node->loc);
     switch (node->kind)
     {
     case ND_IF:
@@ -121,33 +679,40 @@ static void gen_stmt(Node *node)
         int seq = labelseq++;
         if (node->els)
         {
-            gen_expr(node->cond);
-            printf("    cmp %s, 0\n", reg(--top));
-            printf("    je  .L.else.%d\n", seq);
+            gen_branch(node->cond, false, ".L.else", seq);
+            prof_count(nd(node->then)->loc);
             gen_stmt(node->then);
             printf("    jmp .L.end.%d\n", seq);
             printf(".L.else.%d:\n", seq);
+            prof_count(nd(node->els)->loc);
             gen_stmt(node->els);
             printf(".L.end.%d:\n", seq);
+            prof_count(next_loc(node));
         }
         else
         {
-            gen_expr(node->cond);
-            printf("    cmp %s, 0\n", reg(--top));
-            printf("    je  .L.end.%d\n", seq);
+            gen_branch(node->cond, false, ".L.end", seq);
+            prof_count(nd(node->then)->loc);
             gen_stmt(node->then);
             printf(".L.end.%d:\n", seq);
+            prof_count(next_loc(node));
         }
         return;
     }
     case ND_RETURN:
+        prof_count(node->loc);
         gen_expr(node->lhs);
         printf("    mov rax, %s\n", reg(--top));
-        printf("    jmp .L.return\n");
+        printf("    jmp .L.return.%d\n", return_seq);
         return;
     case ND_EXPR_STMT:
-        gen_expr(node->lhs);
-        top--;
+        gen_void_expr(node->lhs);
+        return;
+    case ND_BLOCK:
+        for (NodeId n = node->body; n; n = nd(n)->next)
+        {
+            gen_stmt(n);
+        }
         return;
     case ND_FOR:
     {
@@ -156,20 +721,59 @@ static void gen_stmt(Node *node)
         {
             gen_stmt(node->init);
         }
-        printf(".L.begin.%d:\n", seq);
+
+        if (!opt_rotate_loops)
+        {
+            gen_loop_align();
+            printf(".L.begin.%d:\n", seq);
+            if (node->cond)
+            {
+                gen_loc(expr_loc(node->cond));
+                prof_count(expr_loc(node->cond));
+                gen_branch(node->cond, false, ".L.end", seq);
+            }
+            prof_count(nd(node->then)->loc);
+            gen_stmt(node->then);
+            if (node->inc)
+            {
+                gen_stmt(node->inc);
+            }
+            printf("    jmp .L.begin.%d\n", seq);
+            printf(".L.end.%d:\n", seq);
+            prof_count(next_loc(node));
+            return;
+        }
+
+        // ローテートしたループ
+        // 条件判定は先頭で1回だけ行い、以降はループの末尾で判定して先頭に戻る。
+        // 1回の繰り返しで分岐命令が1つになる
+        int cond_counter = node->cond ? prof_counter(expr_loc(node->cond)) : -1;
         if (node->cond)
         {
-            gen_expr(node->cond);
-            printf("    cmp %s, 0\n", reg(--top));
-            printf("    je  .L.end.%d\n", seq);
+            gen_loc(expr_loc(node->cond));
+            prof_inc(cond_counter);
+            gen_branch(node->cond, false, ".L.end", seq);
         }
+        gen_loop_align();
+        printf(".L.begin.%d:\n", seq);
+        prof_count(nd(node->then)->loc);
         gen_stmt(node->then);
         if (node->inc)
         {
             gen_stmt(node->inc);
         }
-        printf("    jmp .L.begin.%d\n", seq);
+        if (node->cond)
+        {
+            gen_loc(expr_loc(node->cond));
+            prof_inc(cond_counter);
+            gen_branch(node->cond, true, ".L.begin", seq);
+        }
+        else
+        {
+            printf("    jmp .L.begin.%d\n", seq);
+        }
         printf(".L.end.%d:\n", seq);
+        prof_count(next_loc(node));
         return;
     }
     default:
@@ -177,36 +781,213 @@ static void gen_stmt(Node *node)
     }
 }
 
-void codegen(Function *prog)
+// 関数が他の関数を呼び出す場合true。stmt_regsで求める
+static bool has_call;
+
+static int max_regs(int a, int b)
 {
-    // アセンブリの前半部分を出力する
-    printf(".intel_syntax noprefix\n");
-    printf(".global main\n");
-    printf("main:\n");
+    return a > b ? a : b;
+}
+
+/**
+ * @brief 式の評価に使うレジスタ数の上限を求める。タイルによらず、左右どちらを先に評価しても足りる数にする
+ */
+static int expr_regs(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return 1;
+    case ND_ASSIGN:
+        return expr_regs(node->rhs);
+    case ND_FUNCALL:
+    {
+        // 引数は1つずつ評価してスタックに積む
+        has_call = true;
+        int n = 1;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            int r = expr_regs(arg);
+            n = r > n ? r : n;
+        }
+        return n;
+    }
+    case ND_SELECT:
+        // elseの値、thenの値の順に求めてから条件を評価する
+        return max_regs(expr_regs(node->els), max_regs(expr_regs(node->then) + 1, expr_regs(node->cond) + 2));
+    default:
+    {
+        int l = expr_regs(node->lhs);
+        int r = expr_regs(node->rhs);
+        return (l > r ? l : r) + 1;
+    }
+    }
+}
+
+/**
+ * @brief 文の実行に使うレジスタ数の上限を求める
+ */
+static int stmt_regs(NodeId id)
+{
+    if (!id)
+    {
+        return 0;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        return expr_regs(node->lhs);
+    case ND_IF:
+    case ND_FOR:
+    {
+        int n = node->cond ? expr_regs(node->cond) : 0;
+        n = max_regs(n, stmt_regs(node->init));
+        n = max_regs(n, stmt_regs(node->then));
+        n = max_regs(n, stmt_regs(node->els));
+        return max_regs(n, stmt_regs(node->inc));
+    }
+    case ND_BLOCK:
+    {
+        int n = 0;
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            n = max_regs(n, stmt_regs(s));
+        }
+        return n;
+    }
+    default:
+        return 0;
+    }
+}
+
+static void gen_func(Function *fn)
+{
+    return_seq = labelseq++;
+
+    // r12からr15はcallee-savedのため、使う分だけ変数の下に退避する
+    has_call = false;
+    int nregs = 0;
+    for (NodeId n = fn->node; n; n = nd(n)->next)
+    {
+        nregs = max_regs(nregs, stmt_regs(n));
+    }
+    int nsaved = nregs > 6 ? 4 : nregs > 2 ? nregs - 2 : 0;
+    int size = (fn->stack_size + nsaved * 8 + 15) & ~15;
+
+    // 最適化する場合、他の関数を呼び出さない関数は、フレームが不要であればrbpも設定せず、
+    // 128バイト以内であればrspを動かさずにレッドゾーンに置く。
+    // 計測結果の書き出しはスタックに値を積むため、計測する場合はレッドゾーンを使わない
+    bool leaf = !has_call && opt_level > 0;
+    bool frameless = leaf && size == 0;
+    bool red_zone = leaf && size <= 128 && !opt_profile;
+
+    char *prefix = sym_prefix(fn);
+    if (!*prefix)
+    {
+        printf(".global %s\n", fn->name);
+    }
+    printf(".type %s%s, @function\n", prefix, fn->name);
+    printf("%s%s:\n", prefix, fn->name);
 
     // プロローグ
-    // r12 - r15 ar callee-saved registers.
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", prog->stack_size);
-    printf("  mov [rbp-8], r12\n");
-    printf("  mov [rbp-16], r13\n");
-    printf("  mov [rbp-24], r14\n");
-    printf("  mov [rbp-32], r15\n");
+    // CFAは呼び出し直前のrsp。.cfi_*でスタックフレームの形を記録し、
+    // デバッガやプロファイラがスタックを巻き戻せるようにする
+    printf("  .cfi_startproc\n");
+    if (!frameless)
+    {
+        printf("  push rbp\n");
+        printf("  .cfi_def_cfa_offset 16\n");
+        printf("  .cfi_offset rbp, -16\n");
+        printf("  mov rbp, rsp\n");
+        printf("  .cfi_def_cfa_register rbp\n");
+        if (!red_zone)
+        {
+            printf("  sub rsp, %d\n", size);
+        }
+    }
+    for (int i = 0; i < nsaved; i++)
+    {
+        int offset = fn->stack_size + (i + 1) * 8;
+        printf("  mov [rbp-%d], %s\n", offset, reg(i + 2));
+        printf("  .cfi_offset %s, -%d\n", reg(i + 2), offset + 16);
+    }
+
+    // 引数をローカル変数の領域に移す
+    for (Var *var = fn->locals; var; var = var->next)
+    {
+        if (var->id < fn->nparams)
+        {
+            printf("  mov [rbp-%d], %s\n", var->offset, argreg[var->id]);
+        }
+    }
 
-    for (Node *n = prog->node; n; n = n->next)
+    prof_count(fn->node ? nd(fn->node)->loc : 0);
+    for (NodeId n = fn->node; n; n = nd(n)->next)
     {
         gen_stmt(n);
-        assert(top == 0);
+        assert(top == 0 && depth == 0);
     }
 
+    // 末尾まで実行した場合は0を返す
+    printf("    mov rax, 0\n");
+
     // Epilogue
-    printf(".L.return:\n");
-    printf("  mov r12, [rbp-8]\n");
-    printf("  mov r13, [rbp-16]\n");
-    printf("  mov r14, [rbp-24]\n");
-    printf("  mov r15, [rbp-32]\n");
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
+    printf(".L.return.%d:\n", return_seq);
+    if (!*prefix)
+    {
+        prof_emit_dump();
+    }
+    for (int i = 0; i < nsaved; i++)
+    {
+        printf("  mov %s, [rbp-%d]\n", reg(i + 2), fn->stack_size + (i + 1) * 8);
+    }
+    if (!frameless)
+    {
+        if (!red_zone)
+        {
+            printf("  mov rsp, rbp\n");
+        }
+        printf("  pop rbp\n");
+        printf("  .cfi_def_cfa rsp, 8\n");
+    }
     printf("  ret\n");
-}
\ No newline at end of file
+    printf("  .cfi_endproc\n");
+    printf(".size %s%s, .-%s%s\n", prefix, fn->name, prefix, fn->name);
+}
+
+void codegen(Function *prog)
+{
+    // アセンブリの前半部分を出力する
+    printf(".intel_syntax noprefix\n");
+    if (opt_g)
+    {
+        printf(".file 1 \"");
+        for (char *p = input_path; *p; p++)
+        {
+            if (*p == '\\' || *p == '"')
+            {
+                putchar('\\');
+            }
+            putchar(*p);
+        }
+        printf("\"\n");
+    }
+
+    tiles = calloc(node_count(), sizeof(Tile));
+
+    // 呼び出されない関数は出力しない
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        if (is_live(fn))
+        {
+            gen_func(fn);
+        }
+    }
+
+    prof_emit_data();
+}
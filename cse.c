@@ -0,0 +1,360 @@
+#include "orecc.h"
+
+// 値番号の表の項目。演算の種類と、オペランドの値番号または定数・変数の版の組で値を表す
+typedef struct
+{
+    int kind;
+    long a;
+    long b;
+    int vn;
+} Entry;
+
+static Entry *table;
+static int table_cap;
+static int table_len;
+
+// 値番号の数
+static int nvns;
+
+// 各変数の現在の版。代入のたびに新しい版にする
+static int *version;
+static int generation;
+
+// 値番号ごとに、その値を最初に求めた式のノードと、値を保持する一時変数
+static NodeId *avail;
+static Var **temps;
+static int avail_cap;
+
+// 利用可能にした値番号の履歴。分岐やループを抜ける際に巻き戻す
+static int *undo;
+static int undo_len;
+static int undo_cap;
+
+static Function *cur_fn;
+static int ntemps;
+
+static unsigned long hash(int kind, long a, long b)
+{
+    unsigned long h = kind * 0x9e3779b97f4a7c15UL;
+    h = (h ^ a) * 0xff51afd7ed558ccdUL;
+    h = (h ^ b) * 0xc4ceb9fe1a85ec53UL;
+    return h ^ (h >> 29);
+}
+
+static void rehash(void)
+{
+    Entry *old = table;
+    int cap = table_cap;
+    table_cap = cap ? cap * 2 : 256;
+    table = calloc(table_cap, sizeof(Entry));
+    for (int i = 0; i < cap; i++)
+    {
+        if (old[i].vn)
+        {
+            unsigned long h = hash(old[i].kind, old[i].a, old[i].b) & (table_cap - 1);
+            while (table[h].vn)
+            {
+                h = (h + 1) & (table_cap - 1);
+            }
+            table[h] = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * @brief 演算と2つのオペランドの組に対応する値番号を求める。初めての組には新しい値番号を割り当てる
+ */
+static int vn_of(int kind, long a, long b)
+{
+    if (table_len * 2 >= table_cap)
+    {
+        rehash();
+    }
+
+    unsigned long h = hash(kind, a, b) & (table_cap - 1);
+    for (; table[h].vn; h = (h + 1) & (table_cap - 1))
+    {
+        Entry *e = &table[h];
+        if (e->kind == kind && e->a == a && e->b == b)
+        {
+            return e->vn;
+        }
+    }
+
+    table[h] = (Entry){kind, a, b, ++nvns};
+    table_len++;
+
+    if (nvns == avail_cap)
+    {
+        avail_cap *= 2;
+        avail = realloc(avail, sizeof(*avail) * avail_cap);
+        temps = realloc(temps, sizeof(*temps) * avail_cap);
+    }
+    avail[nvns] = 0;
+    temps[nvns] = NULL;
+    return nvns;
+}
+
+/**
+ * @brief 副作用のない式の値番号を求める
+ */
+static int value_number(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return vn_of(ND_NUM, node->val, 0);
+    case ND_VAR:
+        return vn_of(ND_VAR, node->var->id, version[node->var->id]);
+    default:
+        break;
+    }
+
+    long a = value_number(node->lhs);
+    long b = value_number(node->rhs);
+
+    // 可換な演算はオペランドの順序をそろえる
+    bool commutative = node->kind == ND_ADD || node->kind == ND_MUL || node->kind == ND_EQ || node->kind == ND_NE;
+    if (commutative && a > b)
+    {
+        long t = a;
+        a = b;
+        b = t;
+    }
+    return vn_of(node->kind, a, b);
+}
+
+/**
+ * @brief ノード以下で代入される変数に新しい版を割り当てる
+ */
+static void kill_assigned(NodeId id)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return;
+    case ND_ASSIGN:
+        version[nd(node->lhs)->var->id] = ++generation;
+        kill_assigned(node->rhs);
+        return;
+    case ND_IF:
+    case ND_FOR:
+        kill_assigned(node->init);
+        kill_assigned(node->cond);
+        kill_assigned(node->then);
+        kill_assigned(node->els);
+        kill_assigned(node->inc);
+        return;
+    case ND_BLOCK:
+        for (NodeId n = node->body; n; n = nd(n)->next)
+        {
+            kill_assigned(n);
+        }
+        return;
+    case ND_FUNCALL:
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            kill_assigned(arg);
+        }
+        return;
+    default:
+        kill_assigned(node->lhs);
+        kill_assigned(node->rhs);
+        return;
+    }
+}
+
+static void make_available(int vn, NodeId id)
+{
+    // 巻き戻した分岐内で作った一時変数は、この式では使えない
+    avail[vn] = id;
+    temps[vn] = NULL;
+    if (undo_len == undo_cap)
+    {
+        undo_cap = undo_cap ? undo_cap * 2 : 64;
+        undo = realloc(undo, sizeof(*undo) * undo_cap);
+    }
+    undo[undo_len++] = vn;
+}
+
+/**
+ * @brief markの時点より後に利用可能にした値を利用不可に戻す
+ */
+static void rewind_to(int mark)
+{
+    while (undo_len > mark)
+    {
+        avail[undo[--undo_len]] = 0;
+    }
+}
+
+/**
+ * @brief 先に求めた値を再利用する。値を最初に求めた式を一時変数への代入に書き換え、
+ * 2回目以降の式を一時変数の参照に置き換える
+ */
+static void reuse(int vn, NodeId id)
+{
+    Node *node = nd(id);
+    Var *var = temps[vn];
+    if (!var)
+    {
+        char *name = calloc(1, 20);
+        snprintf(name, 20, ".cse.%d", ntemps++);
+        var = temps[vn] = new_local(cur_fn, name);
+
+        NodeId def = avail[vn];
+        NodeId copy = new_node(ND_NUM, 0);
+        replace_node(copy, def);
+        Node *d = nd(def);
+        d->kind = ND_ASSIGN;
+        d->lhs = new_var_node(var, d->loc);
+        d->rhs = copy;
+    }
+
+    node->kind = ND_VAR;
+    node->var = var;
+}
+
+static int visit_expr(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return 0;
+    case ND_ASSIGN:
+    {
+        int n = visit_expr(node->rhs);
+        version[nd(node->lhs)->var->id] = ++generation;
+        return n;
+    }
+    case ND_FUNCALL:
+    {
+        // 呼び出し先は呼び出し元の変数に代入できないため、引数の中の代入だけを反映する
+        int n = 0;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            n += visit_expr(arg);
+        }
+        return n;
+    }
+    default:
+        break;
+    }
+
+    // 副作用のない式は、既に求めた値であれば式全体を置き換える
+    if (is_pure(id))
+    {
+        int vn = value_number(id);
+        if (avail[vn])
+        {
+            reuse(vn, id);
+            return 1;
+        }
+        int n = visit_expr(node->lhs) + visit_expr(node->rhs);
+        make_available(vn, id);
+        return n;
+    }
+
+    return visit_expr(node->lhs) + visit_expr(node->rhs);
+}
+
+static int visit_stmt(NodeId id)
+{
+    if (!id)
+    {
+        return 0;
+    }
+
+    Node *node = nd(id);
+    int n = 0;
+    switch (node->kind)
+    {
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        return visit_expr(node->lhs);
+    case ND_BLOCK:
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            n += visit_stmt(s);
+        }
+        return n;
+    case ND_IF:
+    {
+        // 条件式の値は両方の分岐とその後で使えるが、分岐内で求めた値は合流後には使えない
+        n = visit_expr(node->cond);
+        int mark = undo_len;
+        n += visit_stmt(node->then);
+        rewind_to(mark);
+        n += visit_stmt(node->els);
+        rewind_to(mark);
+        kill_assigned(node->then);
+        kill_assigned(node->els);
+        return n;
+    }
+    case ND_FOR:
+    {
+        // ループ内で代入される変数は、ループの先頭で前回の繰り返しの値と合流する
+        n = visit_stmt(node->init);
+        kill_assigned(node->cond);
+        kill_assigned(node->then);
+        kill_assigned(node->inc);
+        int mark = undo_len;
+        if (node->cond)
+        {
+            n += visit_expr(node->cond);
+        }
+        n += visit_stmt(node->then);
+        n += visit_stmt(node->inc);
+        rewind_to(mark);
+        kill_assigned(node->cond);
+        kill_assigned(node->then);
+        kill_assigned(node->inc);
+        return n;
+    }
+    default:
+        error("invalid statement");
+        return 0;
+    }
+}
+
+int cse(Function *prog)
+{
+    cur_fn = prog;
+    int nvars = prog->locals ? prog->locals->id + 1 : 0;
+
+    // 一時変数は置き換える式ごとに高々1つ作る
+    version = calloc(nvars + node_count(), sizeof(int));
+    avail_cap = 256;
+    avail = calloc(avail_cap, sizeof(*avail));
+    temps = calloc(avail_cap, sizeof(*temps));
+
+    int n = 0;
+    for (NodeId s = prog->node; s; s = nd(s)->next)
+    {
+        n += visit_stmt(s);
+    }
+
+    free(table);
+    free(version);
+    free(avail);
+    free(temps);
+    free(undo);
+    table = NULL;
+    table_cap = table_len = nvns = 0;
+    avail = NULL;
+    temps = NULL;
+    undo = NULL;
+    undo_len = undo_cap = 0;
+    return n;
+}
@@ -0,0 +1,404 @@
+#include "orecc.h"
+
+// 生存変数の集合は変数の番号を添字とするビット集合で表す
+static int nwords;
+
+// falseの場合は解析のみ行い、プログラムを書き換えない
+static bool mutate;
+
+static int changed;
+
+static unsigned long *new_set(unsigned long *src)
+{
+    unsigned long *set = calloc(nwords + 1, sizeof(unsigned long));
+    if (src)
+    {
+        memcpy(set, src, nwords * sizeof(unsigned long));
+    }
+    return set;
+}
+
+static bool has(unsigned long *set, Var *var)
+{
+    return set[var->id / 64] >> (var->id % 64) & 1;
+}
+
+static void add(unsigned long *set, Var *var)
+{
+    set[var->id / 64] |= 1UL << (var->id % 64);
+}
+
+static void del(unsigned long *set, Var *var)
+{
+    set[var->id / 64] &= ~(1UL << (var->id % 64));
+}
+
+/**
+ * @brief dstにsrcを合わせる
+ *
+ * @return dstが変化した場合true
+ */
+static bool merge(unsigned long *dst, unsigned long *src)
+{
+    bool grew = false;
+    for (int i = 0; i < nwords; i++)
+    {
+        grew |= (dst[i] | src[i]) != dst[i];
+        dst[i] |= src[i];
+    }
+    return grew;
+}
+
+static bool is_dead_store(NodeId id, unsigned long *live)
+{
+    Node *node = nd(id);
+    return node->kind == ND_ASSIGN && !has(live, nd(node->lhs)->var);
+}
+
+/**
+ * @brief 代入を右辺の値に置き換える。代入式の値は右辺の値と等しい
+ */
+static void drop_store(NodeId id)
+{
+    replace_node(id, nd(id)->rhs);
+    changed++;
+}
+
+static void make_empty(NodeId id)
+{
+    Node *node = nd(id);
+    node->kind = ND_BLOCK;
+    node->body = 0;
+    changed++;
+}
+
+static bool is_empty(NodeId id)
+{
+    return nd(id)->kind == ND_BLOCK && !nd(id)->body;
+}
+
+/**
+ * @brief 式の評価後に生存している変数の集合から、評価前に生存している変数の集合を求める
+ *
+ * @param id 式のノード
+ * @param live 評価後の生存変数。評価前の生存変数で上書きする
+ */
+static void live_expr(NodeId id, unsigned long *live)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return;
+    case ND_VAR:
+        add(live, node->var);
+        return;
+    case ND_ASSIGN:
+        if (mutate && is_dead_store(id, live))
+        {
+            drop_store(id);
+            live_expr(id, live);
+            return;
+        }
+        del(live, nd(node->lhs)->var);
+        live_expr(node->rhs, live);
+        return;
+    case ND_FUNCALL:
+    {
+        // 引数は先頭から評価するため、末尾の引数から逆にたどる
+        int n = 0;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            n++;
+        }
+        NodeId *args = calloc(n + 1, sizeof(NodeId));
+        n = 0;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            args[n++] = arg;
+        }
+        while (n > 0)
+        {
+            live_expr(args[--n], live);
+        }
+        free(args);
+        return;
+    }
+    case ND_SELECT:
+        // 選択の各部には代入がないため、たどる順は問わない
+        live_expr(node->cond, live);
+        live_expr(node->then, live);
+        live_expr(node->els, live);
+        return;
+    default:
+        // 左辺から評価するため、右辺から逆にたどる
+        live_expr(node->rhs, live);
+        live_expr(node->lhs, live);
+        return;
+    }
+}
+
+static void live_stmt(NodeId id, unsigned long *live);
+
+/**
+ * @brief 文の並びを末尾から解析し、空になった文を並びから外す
+ */
+static void live_list(NodeId *head, unsigned long *live)
+{
+    int len = 0;
+    for (NodeId n = *head; n; n = nd(n)->next)
+    {
+        len++;
+    }
+
+    NodeId *stmts = calloc(len + 1, sizeof(NodeId));
+    int i = 0;
+    for (NodeId n = *head; n; n = nd(n)->next)
+    {
+        stmts[i++] = n;
+    }
+    while (i > 0)
+    {
+        live_stmt(stmts[--i], live);
+    }
+
+    if (mutate)
+    {
+        NodeId *cur = head;
+        for (i = 0; i < len; i++)
+        {
+            if (!is_empty(stmts[i]))
+            {
+                *cur = stmts[i];
+                cur = &nd(stmts[i])->next;
+            }
+        }
+        *cur = 0;
+    }
+    free(stmts);
+}
+
+/**
+ * @brief 文の実行後に生存している変数の集合から、実行前に生存している変数の集合を求める。
+ * mutateがtrueの場合は、不要な代入と副作用のない式文を取り除く
+ *
+ * @param id 文のノード
+ * @param live 実行後の生存変数。実行前の生存変数で上書きする
+ */
+static void live_stmt(NodeId id, unsigned long *live)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        memset(live, 0, nwords * sizeof(unsigned long));
+        live_expr(node->lhs, live);
+        return;
+    case ND_EXPR_STMT:
+        if (mutate)
+        {
+            while (is_dead_store(node->lhs, live))
+            {
+                drop_store(node->lhs);
+            }
+            if (is_removable(node->lhs))
+            {
+                make_empty(id);
+                return;
+            }
+        }
+        live_expr(node->lhs, live);
+        return;
+    case ND_BLOCK:
+        live_list(&node->body, live);
+        return;
+    case ND_IF:
+    {
+        unsigned long *els = new_set(live);
+        live_stmt(node->then, live);
+        if (node->els)
+        {
+            live_stmt(node->els, els);
+        }
+        merge(live, els);
+        free(els);
+
+        if (mutate && node->els && is_empty(node->els))
+        {
+            node->els = 0;
+        }
+        if (mutate && !node->els && is_empty(node->then) && is_removable(node->cond))
+        {
+            make_empty(id);
+            return;
+        }
+        live_expr(node->cond, live);
+        return;
+    }
+    case ND_FOR:
+    {
+        // ループの先頭で生存している変数の集合が収束するまで解析を繰り返してから書き換える
+        unsigned long *head = new_set(live);
+        unsigned long *cur = new_set(NULL);
+        bool save = mutate;
+        mutate = false;
+        for (;;)
+        {
+            memcpy(cur, head, nwords * sizeof(unsigned long));
+            if (node->inc)
+            {
+                live_stmt(node->inc, cur);
+            }
+            live_stmt(node->then, cur);
+            if (node->cond)
+            {
+                // 条件が偽の場合はループを抜ける
+                merge(cur, live);
+                live_expr(node->cond, cur);
+            }
+            if (!merge(head, cur))
+            {
+                break;
+            }
+        }
+        mutate = save;
+
+        if (mutate)
+        {
+            memcpy(cur, head, nwords * sizeof(unsigned long));
+            if (node->inc)
+            {
+                live_stmt(node->inc, cur);
+                if (is_empty(node->inc))
+                {
+                    node->inc = 0;
+                }
+            }
+            live_stmt(node->then, cur);
+            if (node->cond)
+            {
+                merge(cur, live);
+                live_expr(node->cond, cur);
+            }
+        }
+
+        memcpy(live, head, nwords * sizeof(unsigned long));
+        free(head);
+        free(cur);
+
+        if (node->init)
+        {
+            live_stmt(node->init, live);
+            if (mutate && is_empty(node->init))
+            {
+                node->init = 0;
+            }
+        }
+        return;
+    }
+    default:
+        error("invalid statement");
+    }
+}
+
+static void mark_used(NodeId id, bool *used)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return;
+    case ND_VAR:
+        used[node->var->id] = true;
+        return;
+    case ND_IF:
+    case ND_FOR:
+    case ND_SELECT:
+        mark_used(node->init, used);
+        mark_used(node->cond, used);
+        mark_used(node->then, used);
+        mark_used(node->els, used);
+        mark_used(node->inc, used);
+        return;
+    case ND_BLOCK:
+    case ND_FUNCALL:
+        for (NodeId n = node->kind == ND_BLOCK ? node->body : node->args; n; n = nd(n)->next)
+        {
+            mark_used(n, used);
+        }
+        return;
+    default:
+        mark_used(node->lhs, used);
+        mark_used(node->rhs, used);
+        return;
+    }
+}
+
+/**
+ * @brief どこからも参照されない変数をローカル変数から外し、変数の番号を詰める
+ *
+ * @return 外した変数の数
+ */
+static int drop_unused_vars(Function *prog, int nvars)
+{
+    // 引数は呼び出し元が値を渡すため、参照されなくても外さない
+    bool *used = calloc(nvars + 1, sizeof(bool));
+    for (int i = 0; i < prog->nparams; i++)
+    {
+        used[i] = true;
+    }
+    for (NodeId n = prog->node; n; n = nd(n)->next)
+    {
+        mark_used(n, used);
+    }
+
+    int dropped = 0;
+    int len = 0;
+    Var **cur = &prog->locals;
+    while (*cur)
+    {
+        if (used[(*cur)->id])
+        {
+            len++;
+            cur = &(*cur)->next;
+        }
+        else
+        {
+            *cur = (*cur)->next;
+            dropped++;
+        }
+    }
+
+    // 番号はローカル変数の並びの先頭ほど大きい
+    for (Var *var = prog->locals; var; var = var->next)
+    {
+        var->id = --len;
+    }
+    free(used);
+    return dropped;
+}
+
+int dse(Function *prog)
+{
+    int nvars = prog->locals ? prog->locals->id + 1 : 0;
+    nwords = (nvars + 63) / 64;
+
+    // 取り除いた代入の右辺で参照していた変数が新たに不要になるため、変化がなくなるまで繰り返す
+    int total = 0;
+    do
+    {
+        changed = 0;
+        mutate = true;
+        unsigned long *live = new_set(NULL);
+        live_list(&prog->node, live);
+        free(live);
+        total += changed;
+    } while (changed);
+
+    return total + drop_unused_vars(prog, nvars);
+}
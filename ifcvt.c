@@ -0,0 +1,154 @@
+#include "orecc.h"
+
+// 値の式のノード数の上限。選択では両方の値を常に計算するため、分岐予測を外した場合の損失
+// (十数サイクル) を超えない小さな式に限る
+#define MAX_VALUE_NODES 5
+
+// 条件式のノード数の上限。値を計算した後に条件を比較するため、レジスタが足りる大きさに限る
+#define MAX_COND_NODES 7
+
+static int changed;
+
+/**
+ * @brief 1文だけのブロックを中の文にする
+ */
+static NodeId unwrap(NodeId id)
+{
+    while (id && nd(id)->kind == ND_BLOCK && nd(id)->body && !nd(nd(id)->body)->next)
+    {
+        id = nd(id)->body;
+    }
+    return id;
+}
+
+/**
+ * @brief 条件によらず計算してよい値か判定する。副作用も例外もない小さな式に限る
+ */
+static bool is_cheap(NodeId id)
+{
+    return is_removable(id) && count_nodes(id) <= MAX_VALUE_NODES;
+}
+
+/**
+ * @brief 変数への代入だけの文であれば代入のノードを返す
+ */
+static Node *as_store(NodeId id)
+{
+    id = unwrap(id);
+    if (!id || nd(id)->kind != ND_EXPR_STMT)
+    {
+        return NULL;
+    }
+    Node *e = nd(nd(id)->lhs);
+    return e->kind == ND_ASSIGN && nd(e->lhs)->kind == ND_VAR ? e : NULL;
+}
+
+static NodeId new_select(NodeId cond, NodeId then, NodeId els, int loc)
+{
+    NodeId id = new_node(ND_SELECT, loc);
+    nd(id)->cond = cond;
+    nd(id)->then = then;
+    nd(id)->els = els;
+    return id;
+}
+
+/**
+ * @brief if文を値の選択に置き換える
+ *
+ * if (c) return a; else return b;  (elseがなく、直後にreturn bが続く場合も)  ->  return c ? a : b;
+ * if (c) x = a; else x = b;  ->  x = c ? a : b;
+ * if (c) x = a;  ->  x = c ? a : x;
+ */
+static void convert(NodeId id)
+{
+    Node *node = nd(id);
+    if (!is_pure(node->cond) || count_nodes(node->cond) > MAX_COND_NODES)
+    {
+        return;
+    }
+
+    NodeId then = unwrap(node->then);
+    if (nd(then)->kind == ND_RETURN)
+    {
+        NodeId els = node->els ? unwrap(node->els) : node->next;
+        if (!els || nd(els)->kind != ND_RETURN || !is_cheap(nd(then)->lhs) || !is_cheap(nd(els)->lhs))
+        {
+            return;
+        }
+
+        NodeId sel = new_select(node->cond, nd(then)->lhs, nd(els)->lhs, node->loc);
+        NodeId next = node->els ? node->next : nd(els)->next;
+        replace_node(id, new_unary(ND_RETURN, sel, node->loc));
+        nd(id)->next = next;
+        changed++;
+        return;
+    }
+
+    Node *a = as_store(node->then);
+    if (!a || !is_cheap(a->rhs))
+    {
+        return;
+    }
+    Var *var = nd(a->lhs)->var;
+
+    NodeId other;
+    if (node->els)
+    {
+        Node *b = as_store(node->els);
+        if (!b || nd(b->lhs)->var != var || !is_cheap(b->rhs))
+        {
+            return;
+        }
+        other = b->rhs;
+    }
+    else
+    {
+        // 条件が偽の場合は元の値を代入し直す
+        other = new_var_node(var, node->loc);
+    }
+
+    NodeId sel = new_select(node->cond, a->rhs, other, node->loc);
+    NodeId store = new_binary(ND_ASSIGN, new_var_node(var, node->loc), sel, node->loc);
+    replace_node(id, new_unary(ND_EXPR_STMT, store, node->loc));
+    changed++;
+}
+
+static void walk(NodeId id)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    // 内側のif文を先に置き換え、入れ子の選択にできるようにする
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_IF:
+        walk(node->then);
+        walk(node->els);
+        convert(id);
+        return;
+    case ND_FOR:
+        walk(node->then);
+        return;
+    case ND_BLOCK:
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            walk(s);
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+int ifcvt(Function *prog)
+{
+    changed = 0;
+    for (NodeId s = prog->node; s; s = nd(s)->next)
+    {
+        walk(s);
+    }
+    return changed;
+}
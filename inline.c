@@ -0,0 +1,586 @@
+#include "orecc.h"
+
+// 呼び出し箇所の数によらず展開する関数の本体のノード数の上限
+#define SMALL_CALLEE 40
+
+// 展開後の本体のノード数の上限 (元の本体に対する倍率)。returnを分岐の末尾に移す際に後続の文を複製するため増える
+#define MAX_GROWTH 2
+
+/**
+ * @brief 展開中の呼び出し
+ */
+typedef struct
+{
+    /**
+     * @brief 呼び出し先の変数の番号を添字とする、呼び出し元に作った変数
+     */
+    Var **vars;
+
+    /**
+     * @brief 戻り値を代入する変数
+     */
+    Var *ret;
+
+    /**
+     * @brief 呼び出しの位置。展開したノードの位置に使う
+     */
+    int loc;
+
+    /**
+     * @brief まだ複製してよいノード数
+     */
+    int budget;
+
+    /**
+     * @brief returnがループの中にある場合や、複製が大きくなりすぎる場合false
+     */
+    bool ok;
+} Expansion;
+
+/**
+ * @brief 文の並びの続き。入れ子の文の並びを抜けた後に実行する文の並びをたどる
+ */
+typedef struct Cont Cont;
+struct Cont
+{
+    NodeId stmt;
+    Cont *up;
+};
+
+static Function *cur_fn;
+static Expansion *cur;
+static int changed;
+
+// 文の中でこれまでに評価した部分が、副作用も例外もなく評価を後に回せる場合true
+static bool clean;
+
+/**
+ * @brief ノード以下の呼び出しについて、呼び出し先の呼び出し箇所の数にdeltaを加える
+ */
+static void count_calls(NodeId id, int delta)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return;
+    case ND_IF:
+    case ND_FOR:
+        count_calls(node->init, delta);
+        count_calls(node->cond, delta);
+        count_calls(node->then, delta);
+        count_calls(node->els, delta);
+        count_calls(node->inc, delta);
+        return;
+    case ND_BLOCK:
+    case ND_FUNCALL:
+        if (node->kind == ND_FUNCALL)
+        {
+            node->func->ncalls += delta;
+        }
+        for (NodeId n = node->kind == ND_BLOCK ? node->body : node->args; n; n = nd(n)->next)
+        {
+            count_calls(n, delta);
+        }
+        return;
+    default:
+        count_calls(node->lhs, delta);
+        count_calls(node->rhs, delta);
+        return;
+    }
+}
+
+/**
+ * @brief 文の並びの中の呼び出しについて、呼び出し先の呼び出し箇所の数にdeltaを加える
+ */
+static void count_seq_calls(NodeId seq, int delta)
+{
+    for (NodeId s = seq; s; s = nd(s)->next)
+    {
+        count_calls(s, delta);
+    }
+}
+
+/**
+ * @brief 呼び出し箇所を1つ減らす。呼び出されなくなった関数の本体にある呼び出しも減らす
+ */
+static void release(Function *fn)
+{
+    if (--fn->ncalls == 0 && !is_live(fn))
+    {
+        count_seq_calls(fn->node, -1);
+    }
+}
+
+/**
+ * @brief 関数の本体のノード数を数える
+ */
+static int body_size(Function *fn)
+{
+    int n = 0;
+    for (NodeId s = fn->node; s; s = nd(s)->next)
+    {
+        n += count_nodes(s);
+    }
+    return n;
+}
+
+static bool has_return(NodeId id)
+{
+    if (!id)
+    {
+        return false;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        return true;
+    case ND_IF:
+        return has_return(node->then) || has_return(node->els);
+    case ND_FOR:
+        return has_return(node->then);
+    case ND_BLOCK:
+        for (NodeId n = node->body; n; n = nd(n)->next)
+        {
+            if (has_return(n))
+            {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief 文がどの経路でもreturnで終わるか判定する
+ */
+static bool always_returns(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        return true;
+    case ND_IF:
+        return node->els && always_returns(node->then) && always_returns(node->els);
+    case ND_BLOCK:
+        for (NodeId n = node->body; n; n = nd(n)->next)
+        {
+            if (always_returns(n))
+            {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief 呼び出し先の変数の参照を呼び出し元に作った変数の参照に置き換える
+ */
+static void remap(NodeId id)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return;
+    case ND_VAR:
+        node->var = cur->vars[node->var->id];
+        return;
+    case ND_IF:
+    case ND_FOR:
+        remap(node->init);
+        remap(node->cond);
+        remap(node->then);
+        remap(node->els);
+        remap(node->inc);
+        return;
+    case ND_BLOCK:
+    case ND_FUNCALL:
+        for (NodeId n = node->kind == ND_BLOCK ? node->body : node->args; n; n = nd(n)->next)
+        {
+            remap(n);
+        }
+        return;
+    default:
+        remap(node->lhs);
+        remap(node->rhs);
+        return;
+    }
+}
+
+static NodeId copy_remap(NodeId id)
+{
+    NodeId copy = copy_tree(id);
+    remap(copy);
+    cur->budget -= count_nodes(copy);
+    if (cur->budget < 0)
+    {
+        cur->ok = false;
+    }
+    return copy;
+}
+
+/**
+ * @brief 戻り値の変数に値を代入する文を作る
+ */
+static NodeId set_ret(NodeId val)
+{
+    NodeId var = new_var_node(cur->ret, cur->loc);
+    return new_unary(ND_EXPR_STMT, new_binary(ND_ASSIGN, var, val, cur->loc), cur->loc);
+}
+
+static NodeId expand_seq(NodeId id, Cont *k);
+
+/**
+ * @brief 文の並びを分岐先に置ける1つの文にする。2文以上の場合はブロックで囲む
+ */
+static NodeId to_stmt(NodeId seq)
+{
+    if (!seq || !nd(seq)->next)
+    {
+        return seq;
+    }
+    NodeId block = new_node(ND_BLOCK, cur->loc);
+    nd(block)->body = seq;
+    return block;
+}
+
+/**
+ * @brief returnを含む文を複製する。returnの後に続く文がなくなるよう、後続の文は分岐の中に移す
+ *
+ * @param id 文。0の場合は後続の文の並びを複製する
+ * @param k 文の後に実行する文の並び。NULLの場合は関数の末尾
+ */
+static NodeId expand_stmt(NodeId id, Cont *k)
+{
+    if (!cur->ok)
+    {
+        return 0;
+    }
+    if (!id)
+    {
+        // 末尾まで実行した場合は0を返す
+        return k ? expand_seq(k->stmt, k->up) : set_ret(new_num(0, cur->loc));
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        return set_ret(copy_remap(node->lhs));
+    case ND_BLOCK:
+        return expand_seq(node->body, &(Cont){node->next, k});
+    case ND_IF:
+    {
+        // 常にreturnする分岐には後続の文を移さない
+        Cont rest = {node->next, k};
+        NodeId copy = new_node(ND_IF, node->loc);
+        NodeId cond = copy_remap(node->cond);
+        NodeId then = to_stmt(expand_stmt(node->then, always_returns(node->then) ? NULL : &rest));
+        NodeId els = to_stmt(node->els && always_returns(node->els) ? expand_stmt(node->els, NULL) : expand_stmt(node->els, &rest));
+        nd(copy)->cond = cond;
+        nd(copy)->then = then;
+        nd(copy)->els = els;
+        return copy;
+    }
+    default:
+        cur->ok = false;
+        return 0;
+    }
+}
+
+/**
+ * @brief 呼び出し先の文の並びを、returnを戻り値の変数への代入に置き換えて複製する
+ *
+ * @param id 文の並びの先頭
+ * @param k 文の並びの後に実行する文の並び。NULLの場合は関数の末尾
+ * @return 複製した文の並びの先頭
+ */
+static NodeId expand_seq(NodeId id, Cont *k)
+{
+    NodeId head = 0;
+    NodeId *tail = &head;
+    while (id && !has_return(id) && cur->ok)
+    {
+        *tail = copy_remap(id);
+        tail = &nd(*tail)->next;
+        id = nd(id)->next;
+    }
+    *tail = expand_stmt(id, k);
+    return head;
+}
+
+/**
+ * @brief 展開した変数の名前を「関数名.変数名」にする。戻り値の変数はキーワードのreturnを名前にし、呼び出し先の変数と区別する
+ */
+static char *local_name(Function *fn, char *name)
+{
+    int len = strlen(fn->name) + strlen(name) + 2;
+    char *buf = calloc(1, len);
+    snprintf(buf, len, "%s.%s", fn->name, name);
+    return buf;
+}
+
+/**
+ * @brief 呼び出しを、引数の代入と関数の本体の並びに置き換える
+ *
+ * @param id 呼び出しのノード
+ * @param ret 戻り値を代入する変数。NULLの場合は新しく作る
+ * @return 呼び出しの前に実行する文の並び。展開しない場合は0
+ */
+static NodeId expand(NodeId id, Var *ret)
+{
+    Node *node = nd(id);
+    Function *fn = node->func;
+    int nvars = fn->locals ? fn->locals->id + 1 : 0;
+
+    Var *locals = cur_fn->locals;
+    Expansion e = {calloc(nvars + 1, sizeof(Var *)), ret, node->loc, body_size(fn) * MAX_GROWTH + 8, true};
+    for (Var *var = fn->locals; var; var = var->next)
+    {
+        e.vars[var->id] = new_local(cur_fn, local_name(fn, var->name));
+    }
+    if (!e.ret)
+    {
+        e.ret = new_local(cur_fn, local_name(fn, "return"));
+    }
+
+    // 引数を仮引数の変数に代入してから本体を実行する
+    Expansion *saved = cur;
+    cur = &e;
+    NodeId head = 0;
+    NodeId *tail = &head;
+    int i = 0;
+    for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+    {
+        NodeId param = new_var_node(e.vars[i++], node->loc);
+        *tail = new_unary(ND_EXPR_STMT, new_binary(ND_ASSIGN, param, copy_tree(arg), node->loc), node->loc);
+        tail = &nd(*tail)->next;
+    }
+    *tail = expand_seq(fn->node, NULL);
+    cur = saved;
+    free(e.vars);
+    if (!e.ok)
+    {
+        cur_fn->locals = locals;
+        return 0;
+    }
+
+    count_seq_calls(head, 1);
+    release(fn);
+    node->kind = ND_VAR;
+    node->var = e.ret;
+    changed++;
+    return head;
+}
+
+/**
+ * @brief 関数を呼び出し元に展開するか判定する。小さな関数は常に、呼び出し箇所が1つの関数は
+ * 展開すると元の関数を出力しなくて済むため大きさによらず展開する
+ */
+static bool should_inline(Function *fn)
+{
+    // 再帰呼び出しでは、呼び出し先の本体は展開した呼び出しをまだ文の前に置いていない
+    if (fn->inlining)
+    {
+        return false;
+    }
+
+    // 呼び出し先の中の呼び出しを先に展開する
+    if (!fn->inlined)
+    {
+        Function *saved_fn = cur_fn;
+        bool saved_clean = clean;
+        inliner(fn);
+        cur_fn = saved_fn;
+        clean = saved_clean;
+    }
+    return body_size(fn) <= SMALL_CALLEE || (fn->ncalls == 1 && strcmp(fn->name, "main"));
+}
+
+/**
+ * @brief 式を評価順にたどり、文の前に移しても結果が変わらない呼び出しを展開して文の前に置く。
+ * 呼び出しより前に評価する部分が値を読むだけで、引数に代入がない場合に移せる
+ *
+ * @param id 式のノード
+ * @param tail 文の前に置く文の並びの末尾。展開した本体をつなぎ、新しい末尾に進める
+ */
+static void hoist_calls(NodeId id, NodeId **tail)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return;
+    case ND_ASSIGN:
+        hoist_calls(node->rhs, tail);
+        clean = false;
+        return;
+    case ND_FUNCALL:
+    {
+        bool pure_args = true;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            hoist_calls(arg, tail);
+            pure_args = pure_args && is_pure(arg);
+        }
+        NodeId body = clean && pure_args && should_inline(node->func) ? expand(id, NULL) : 0;
+        if (!body)
+        {
+            clean = false;
+            return;
+        }
+        **tail = body;
+        while (**tail)
+        {
+            *tail = &nd(**tail)->next;
+        }
+        return;
+    }
+    default:
+        hoist_calls(node->lhs, tail);
+        hoist_calls(node->rhs, tail);
+        clean = clean && !may_trap(id);
+        return;
+    }
+}
+
+static void walk(NodeId id);
+
+/**
+ * @brief 文の中の呼び出しを展開する。展開した本体は文の前に並べ、文と合わせたブロックに置き換える
+ */
+static void inline_stmt(NodeId id)
+{
+    Node *node = nd(id);
+    NodeId pre = 0;
+    NodeId *tail = &pre;
+    clean = true;
+
+    switch (node->kind)
+    {
+    case ND_EXPR_STMT:
+    {
+        // v = f(...) は戻り値を直接vに代入し、文そのものを取り除く
+        Node *e = nd(node->lhs);
+        if (e->kind == ND_ASSIGN && nd(e->lhs)->kind == ND_VAR && nd(e->rhs)->kind == ND_FUNCALL)
+        {
+            Node *call = nd(e->rhs);
+            bool pure_args = true;
+            for (NodeId arg = call->args; arg; arg = nd(arg)->next)
+            {
+                hoist_calls(arg, &tail);
+                pure_args = pure_args && is_pure(arg);
+            }
+            if (clean && pure_args && should_inline(call->func))
+            {
+                NodeId body = expand(e->rhs, nd(e->lhs)->var);
+                if (body)
+                {
+                    *tail = body;
+                    node->kind = ND_BLOCK;
+                    node->body = pre;
+                    return;
+                }
+            }
+            clean = false;
+        }
+        hoist_calls(node->lhs, &tail);
+        break;
+    }
+    case ND_RETURN:
+        hoist_calls(node->lhs, &tail);
+        break;
+    case ND_IF:
+        hoist_calls(node->cond, &tail);
+        walk(node->then);
+        walk(node->els);
+        break;
+    case ND_FOR:
+        if (node->init)
+        {
+            hoist_calls(nd(node->init)->lhs, &tail);
+        }
+        walk(node->then);
+        break;
+    default:
+        return;
+    }
+
+    if (!pre)
+    {
+        return;
+    }
+
+    // 元の文を複製して展開した本体の後に置く。呼び出しだけの式文は戻り値を使わないため置かない
+    if (node->kind != ND_EXPR_STMT || nd(node->lhs)->kind != ND_VAR)
+    {
+        NodeId copy = new_node(node->kind, node->loc);
+        *nd(copy) = *node;
+        nd(copy)->next = 0;
+        *tail = copy;
+    }
+    node->kind = ND_BLOCK;
+    node->body = pre;
+}
+
+static void walk(NodeId id)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    if (node->kind == ND_BLOCK)
+    {
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            walk(s);
+        }
+        return;
+    }
+    inline_stmt(id);
+}
+
+int inliner(Function *prog)
+{
+    if (prog->inlined)
+    {
+        return 0;
+    }
+    prog->inlined = true;
+    prog->inlining = true;
+
+    int saved = changed;
+    changed = 0;
+    cur_fn = prog;
+    for (NodeId s = prog->node; s; s = nd(s)->next)
+    {
+        walk(s);
+    }
+    prog->inlining = false;
+    int n = changed;
+    changed = saved + n;
+    return n;
+}
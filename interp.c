@@ -0,0 +1,705 @@
+#include "orecc.h"
+#include <signal.h>
+
+// GCC/Clangではラベルのアドレスを使ったスレッデッドコードで命令を振り分ける
+#if defined(__GNUC__) && !defined(INTERP_SWITCH_DISPATCH)
+#define THREADED 1
+#endif
+
+/**
+ * @brief バイトコードの命令の種類
+ */
+typedef enum
+{
+    OP_MOV,  // r[a] = r[b]
+    OP_ADD,  // r[a] = r[b] + r[c]
+    OP_SUB,  // r[a] = r[b] - r[c]
+    OP_MUL,  // r[a] = r[b] * r[c]
+    OP_DIV,  // r[a] = r[b] / r[c]
+    OP_UDIV, // r[a] = (unsigned long)r[b] / (unsigned long)r[c]
+    OP_SHR,  // r[a] = (unsigned long)r[b] >> r[c]
+    OP_EQ,   // r[a] = r[b] == r[c]
+    OP_NE,   // r[a] = r[b] != r[c]
+    OP_LT,   // r[a] = r[b] < r[c]
+    OP_LE,   // r[a] = r[b] <= r[c]
+    OP_CMOV, // if (r[c]) r[a] = r[b]
+    OP_JMP,  // pc = c
+    OP_JZ,   // if (r[a] == 0) pc = c
+    OP_JNZ,  // if (r[a] != 0) pc = c
+    OP_JEQ,  // if (r[a] == r[b]) pc = c
+    OP_JNE,  // if (r[a] != r[b]) pc = c
+    OP_JLT,  // if (r[a] < r[b]) pc = c
+    OP_JLE,  // if (r[a] <= r[b]) pc = c
+    OP_JGT,  // if (r[a] > r[b]) pc = c
+    OP_JGE,  // if (r[a] >= r[b]) pc = c
+    OP_CALL, // r[a] = 関数b(r[c], r[c + 1], ...)
+    OP_RET,  // return r[a]
+    OP_END,  // return 0
+} Opcode;
+
+/**
+ * @brief バイトコードの命令。a, b, cはレジスタ番号または分岐先
+ */
+typedef struct
+{
+    int op;
+    int a;
+    int b;
+    int c;
+} Insn;
+
+// 生成中のバイトコード
+static Insn *code;
+static int ncode;
+static int code_cap;
+
+// レジスタの割り当て
+// [0, nvars) はローカル変数、[nvars, nvars + nconsts) は定数、それ以降は一時的な値に使う
+static int nvars;
+static long *consts;
+static int nconsts;
+static int tmp_base;
+static int ntmp;
+static int nregs;
+
+/**
+ * @brief 関数のバイトコードとレジスタの割り当て
+ */
+typedef struct
+{
+    Function *fn;
+    int entry;
+    int nparams;
+    int nvars;
+    long *consts;
+    int nconsts;
+    int nregs;
+} Proc;
+
+// 呼び出されうる関数の一覧。OP_CALLのbはこの添字
+static Proc *procs;
+static int nprocs;
+
+// 呼び出しで積むレジスタと戻り先の上限。超えた場合はネイティブのスタックオーバーフローと同様にSIGSEGVにする
+#define REG_STACK_SIZE (1 << 24)
+#define CALL_DEPTH (1 << 20)
+
+static int emit(int op, int a, int b, int c)
+{
+    if (ncode == code_cap)
+    {
+        code_cap = code_cap ? code_cap * 2 : 256;
+        code = realloc(code, sizeof(*code) * code_cap);
+    }
+    code[ncode] = (Insn){op, a, b, c};
+    return ncode++;
+}
+
+static int alloc_tmp(void)
+{
+    int r = tmp_base + ntmp++;
+    if (nregs <= r)
+    {
+        nregs = r + 1;
+    }
+    return r;
+}
+
+/**
+ * @brief 定数の表に値を追加する。重複はgather_constsの後で取り除く
+ */
+static void add_const(long val, int *cap)
+{
+    if (nconsts == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 64;
+        consts = realloc(consts, sizeof(*consts) * *cap);
+    }
+    consts[nconsts++] = val;
+}
+
+static void gather_consts(NodeId id, int *cap)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        add_const(node->val, cap);
+        return;
+    case ND_VAR:
+        return;
+    case ND_FUNCALL:
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            gather_consts(arg, cap);
+        }
+        return;
+    case ND_IF:
+    case ND_SELECT:
+        gather_consts(node->cond, cap);
+        gather_consts(node->then, cap);
+        gather_consts(node->els, cap);
+        return;
+    case ND_FOR:
+        gather_consts(node->init, cap);
+        gather_consts(node->cond, cap);
+        gather_consts(node->inc, cap);
+        gather_consts(node->then, cap);
+        return;
+    case ND_BLOCK:
+        for (NodeId n = node->body; n; n = nd(n)->next)
+        {
+            gather_consts(n, cap);
+        }
+        return;
+    default:
+        gather_consts(node->lhs, cap);
+        gather_consts(node->rhs, cap);
+        return;
+    }
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(long *)a;
+    long y = *(long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief 定数を保持するレジスタの番号を求める
+ */
+static int const_reg(long val)
+{
+    long *p = bsearch(&val, consts, nconsts, sizeof(long), compare_long);
+    assert(p);
+    return nvars + (p - consts);
+}
+
+/**
+ * @brief 式をバイトコードに変換する
+ *
+ * @param id 式のノード
+ * @param dst 結果を格納するレジスタ。-1の場合は任意のレジスタ
+ * @return 結果を保持するレジスタ
+ */
+static int lower_expr(NodeId id, int dst)
+{
+    Node *node = nd(id);
+    int r;
+
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        r = node->kind == ND_NUM ? const_reg(node->val) : node->var->id;
+        if (dst < 0 || dst == r)
+        {
+            return r;
+        }
+        emit(OP_MOV, dst, r, 0);
+        return dst;
+    case ND_ASSIGN:
+    {
+        assert(nd(node->lhs)->kind == ND_VAR);
+        int var = nd(node->lhs)->var->id;
+        r = lower_expr(node->rhs, var);
+        if (r != var)
+        {
+            emit(OP_MOV, var, r, 0);
+        }
+        if (dst < 0 || dst == var)
+        {
+            return var;
+        }
+        emit(OP_MOV, dst, var, 0);
+        return dst;
+    }
+    case ND_FUNCALL:
+    {
+        // 引数を連続したレジスタに置き、呼び出し先のレジスタはその先頭から始める。
+        // 呼び出し先の引数はレジスタの先頭に並ぶため、引数を移す必要はない
+        int base = ntmp;
+        int nargs = 0;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            nargs++;
+        }
+        int first = tmp_base + ntmp;
+        for (int i = 0; i < nargs; i++)
+        {
+            alloc_tmp();
+        }
+        int i = 0;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            lower_expr(arg, first + i++);
+        }
+
+        int callee = 0;
+        while (procs[callee].fn != node->func)
+        {
+            callee++;
+        }
+        ntmp = base;
+        r = dst < 0 ? alloc_tmp() : dst;
+        emit(OP_CALL, r, callee, first);
+        return r;
+    }
+    case ND_SELECT:
+    {
+        // 結果のレジスタは値を求める前に確保し、値の一時レジスタと重ならないようにする
+        int base = ntmp;
+        r = dst < 0 ? alloc_tmp() : dst;
+        int cond = lower_expr(node->cond, -1);
+        int then = lower_expr(node->then, -1);
+        int els = lower_expr(node->els, -1);
+
+        // 結果の変数が条件やthenの値を保持する場合は、一時レジスタで選んでから移す
+        int t = r == cond || r == then ? alloc_tmp() : r;
+        if (t != els)
+        {
+            emit(OP_MOV, t, els, 0);
+        }
+        emit(OP_CMOV, t, then, cond);
+        if (t != r)
+        {
+            emit(OP_MOV, r, t, 0);
+        }
+        ntmp = base + (dst < 0);
+        return r;
+    }
+    }
+
+    int op;
+    switch (node->kind)
+    {
+    case ND_ADD:
+        op = OP_ADD;
+        break;
+    case ND_SUB:
+        op = OP_SUB;
+        break;
+    case ND_MUL:
+        op = OP_MUL;
+        break;
+    case ND_DIV:
+        op = OP_DIV;
+        break;
+    case ND_UDIV:
+        op = OP_UDIV;
+        break;
+    case ND_SHR:
+        op = OP_SHR;
+        break;
+    case ND_EQ:
+        op = OP_EQ;
+        break;
+    case ND_NE:
+        op = OP_NE;
+        break;
+    case ND_LT:
+        op = OP_LT;
+        break;
+    case ND_LE:
+        op = OP_LE;
+        break;
+    default:
+        error("invalid expression");
+    }
+
+    int base = ntmp;
+    int lhs = lower_expr(node->lhs, -1);
+
+    // 右辺が左辺の変数に代入する場合に備え、代入前の値を退避する
+    if (lhs < nvars && !is_pure(node->rhs))
+    {
+        int t = alloc_tmp();
+        emit(OP_MOV, t, lhs, 0);
+        lhs = t;
+    }
+    int rhs = lower_expr(node->rhs, -1);
+
+    ntmp = base;
+    r = dst < 0 ? alloc_tmp() : dst;
+    emit(op, r, lhs, rhs);
+    return r;
+}
+
+/**
+ * @brief 条件式の値がwhenのときに分岐する命令を出力する。分岐先は後で設定する
+ *
+ * @param id 条件式のノード
+ * @param when 分岐する条件
+ * @return 分岐命令の位置
+ */
+static int lower_branch(NodeId id, bool when)
+{
+    Node *node = nd(id);
+    int base = ntmp;
+
+    // 比較と分岐を1命令にまとめる
+    int op = -1;
+    switch (node->kind)
+    {
+    case ND_EQ:
+        op = when ? OP_JEQ : OP_JNE;
+        break;
+    case ND_NE:
+        op = when ? OP_JNE : OP_JEQ;
+        break;
+    case ND_LT:
+        op = when ? OP_JLT : OP_JGE;
+        break;
+    case ND_LE:
+        op = when ? OP_JLE : OP_JGT;
+        break;
+    }
+
+    if (op >= 0)
+    {
+        int lhs = lower_expr(node->lhs, -1);
+        if (lhs < nvars && !is_pure(node->rhs))
+        {
+            int t = alloc_tmp();
+            emit(OP_MOV, t, lhs, 0);
+            lhs = t;
+        }
+        int rhs = lower_expr(node->rhs, -1);
+        ntmp = base;
+        return emit(op, lhs, rhs, -1);
+    }
+
+    int r = lower_expr(id, -1);
+    ntmp = base;
+    return emit(when ? OP_JNZ : OP_JZ, r, 0, -1);
+}
+
+static void lower_stmt(NodeId id)
+{
+    Node *node = nd(id);
+    int base = ntmp;
+
+    switch (node->kind)
+    {
+    case ND_IF:
+    {
+        int jelse = lower_branch(node->cond, false);
+        lower_stmt(node->then);
+        if (node->els)
+        {
+            int jend = emit(OP_JMP, 0, 0, -1);
+            code[jelse].c = ncode;
+            lower_stmt(node->els);
+            code[jend].c = ncode;
+        }
+        else
+        {
+            code[jelse].c = ncode;
+        }
+        return;
+    }
+    case ND_FOR:
+    {
+        // コード生成と同様にローテートした形に変換する
+        if (node->init)
+        {
+            lower_stmt(node->init);
+        }
+        int jend = node->cond ? lower_branch(node->cond, false) : -1;
+        int begin = ncode;
+        lower_stmt(node->then);
+        if (node->inc)
+        {
+            lower_stmt(node->inc);
+        }
+        if (node->cond)
+        {
+            code[lower_branch(node->cond, true)].c = begin;
+            code[jend].c = ncode;
+        }
+        else
+        {
+            emit(OP_JMP, 0, 0, begin);
+        }
+        return;
+    }
+    case ND_BLOCK:
+        for (NodeId n = node->body; n; n = nd(n)->next)
+        {
+            lower_stmt(n);
+        }
+        return;
+    case ND_RETURN:
+        emit(OP_RET, lower_expr(node->lhs, -1), 0, 0);
+        ntmp = base;
+        return;
+    case ND_EXPR_STMT:
+        lower_expr(node->lhs, -1);
+        ntmp = base;
+        return;
+    default:
+        error("invalid statement");
+    }
+}
+
+/**
+ * @brief バイトコードを実行する
+ *
+ * @param pc 実行を開始する命令
+ * @param r レジスタ
+ * @return 戻り値
+ */
+static long run(Insn *pc, long *r)
+{
+    Insn *start = code;
+
+    // 呼び出し元の戻り先、レジスタ、戻り値を格納するレジスタ
+    static struct
+    {
+        Insn *pc;
+        long *r;
+        int dst;
+    } frames[CALL_DEPTH];
+    int depth = 0;
+    long *reg_end = r + REG_STACK_SIZE;
+    long val;
+
+#ifdef THREADED
+    static void *labels[] = {
+        [OP_MOV] = &&L_OP_MOV,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_UDIV] = &&L_OP_UDIV,
+        [OP_SHR] = &&L_OP_SHR,
+        [OP_EQ] = &&L_OP_EQ,
+        [OP_NE] = &&L_OP_NE,
+        [OP_LT] = &&L_OP_LT,
+        [OP_LE] = &&L_OP_LE,
+        [OP_CMOV] = &&L_OP_CMOV,
+        [OP_JMP] = &&L_OP_JMP,
+        [OP_JZ] = &&L_OP_JZ,
+        [OP_JNZ] = &&L_OP_JNZ,
+        [OP_JEQ] = &&L_OP_JEQ,
+        [OP_JNE] = &&L_OP_JNE,
+        [OP_JLT] = &&L_OP_JLT,
+        [OP_JLE] = &&L_OP_JLE,
+        [OP_JGT] = &&L_OP_JGT,
+        [OP_JGE] = &&L_OP_JGE,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_RET] = &&L_OP_RET,
+        [OP_END] = &&L_OP_END,
+    };
+#define CASE(op) L_##op:
+#define DISPATCH() goto *labels[pc->op]
+#else
+#define CASE(op) case op:
+#define DISPATCH() continue
+#endif
+
+    // switchによる振り分けではcontinueで先頭に戻るため、do-whileで囲まない
+#define NEXT() \
+    pc++;      \
+    DISPATCH()
+#define BRANCH(cond)                          \
+    pc = (cond) ? start + pc->c : pc + 1; \
+    DISPATCH()
+
+    // 2の補数で桁あふれさせるため、加減乗算は符号なしで行う
+#define ARITH(op) (long)((unsigned long)r[pc->b] op(unsigned long) r[pc->c])
+
+#ifdef THREADED
+    DISPATCH();
+#else
+    for (;;)
+        switch (pc->op)
+#endif
+    {
+        CASE(OP_MOV)
+        r[pc->a] = r[pc->b];
+        NEXT();
+        CASE(OP_ADD)
+        r[pc->a] = ARITH(+);
+        NEXT();
+        CASE(OP_SUB)
+        r[pc->a] = ARITH(-);
+        NEXT();
+        CASE(OP_MUL)
+        r[pc->a] = ARITH(*);
+        NEXT();
+        CASE(OP_DIV)
+        // idivと同様に、0除算と桁あふれはSIGFPEになる
+        if (r[pc->c] == 0 || (r[pc->b] == LONG_MIN && r[pc->c] == -1))
+        {
+            raise(SIGFPE);
+        }
+        r[pc->a] = r[pc->b] / r[pc->c];
+        NEXT();
+        CASE(OP_UDIV)
+        if (r[pc->c] == 0)
+        {
+            raise(SIGFPE);
+        }
+        r[pc->a] = (unsigned long)r[pc->b] / (unsigned long)r[pc->c];
+        NEXT();
+        CASE(OP_SHR)
+        // shrと同様に、シフト量は下位6ビットだけを使う
+        r[pc->a] = (unsigned long)r[pc->b] >> (r[pc->c] & 63);
+        NEXT();
+        CASE(OP_EQ)
+        r[pc->a] = r[pc->b] == r[pc->c];
+        NEXT();
+        CASE(OP_NE)
+        r[pc->a] = r[pc->b] != r[pc->c];
+        NEXT();
+        CASE(OP_LT)
+        r[pc->a] = r[pc->b] < r[pc->c];
+        NEXT();
+        CASE(OP_LE)
+        r[pc->a] = r[pc->b] <= r[pc->c];
+        NEXT();
+        CASE(OP_CMOV)
+        if (r[pc->c])
+        {
+            r[pc->a] = r[pc->b];
+        }
+        NEXT();
+        CASE(OP_JMP)
+        BRANCH(true);
+        CASE(OP_JZ)
+        BRANCH(r[pc->a] == 0);
+        CASE(OP_JNZ)
+        BRANCH(r[pc->a] != 0);
+        CASE(OP_JEQ)
+        BRANCH(r[pc->a] == r[pc->b]);
+        CASE(OP_JNE)
+        BRANCH(r[pc->a] != r[pc->b]);
+        CASE(OP_JLT)
+        BRANCH(r[pc->a] < r[pc->b]);
+        CASE(OP_JLE)
+        BRANCH(r[pc->a] <= r[pc->b]);
+        CASE(OP_JGT)
+        BRANCH(r[pc->a] > r[pc->b]);
+        CASE(OP_JGE)
+        BRANCH(r[pc->a] >= r[pc->b]);
+        CASE(OP_CALL)
+        {
+            Proc *p = &procs[pc->b];
+            long *callee = r + pc->c;
+            if (depth == CALL_DEPTH || reg_end - callee < p->nregs)
+            {
+                raise(SIGSEGV);
+            }
+            frames[depth].pc = pc + 1;
+            frames[depth].r = r;
+            frames[depth].dst = pc->a;
+            depth++;
+
+            // 引数以外の変数を0にし、定数を置く
+            r = callee;
+            memset(r + p->nparams, 0, sizeof(long) * (p->nvars - p->nparams));
+            memcpy(r + p->nvars, p->consts, sizeof(long) * p->nconsts);
+            pc = start + p->entry;
+            DISPATCH();
+        }
+        CASE(OP_RET)
+        val = r[pc->a];
+        goto ret;
+        CASE(OP_END)
+        val = 0;
+    ret:
+        if (depth == 0)
+        {
+            return val;
+        }
+        depth--;
+        pc = frames[depth].pc;
+        r = frames[depth].r;
+        r[frames[depth].dst] = val;
+        DISPATCH();
+    }
+
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH
+#undef ARITH
+}
+
+/**
+ * @brief 関数をバイトコードに変換する
+ */
+static void lower_func(Proc *p)
+{
+    Function *fn = p->fn;
+
+    // ローカル変数と定数にレジスタを割り当てる
+    nvars = fn->locals ? fn->locals->id + 1 : 0;
+
+    consts = NULL;
+    nconsts = 0;
+    int cap = 0;
+    for (NodeId n = fn->node; n; n = nd(n)->next)
+    {
+        gather_consts(n, &cap);
+    }
+    qsort(consts, nconsts, sizeof(long), compare_long);
+    int uniq = 0;
+    for (int i = 0; i < nconsts; i++)
+    {
+        if (uniq == 0 || consts[uniq - 1] != consts[i])
+        {
+            consts[uniq++] = consts[i];
+        }
+    }
+    nconsts = uniq;
+    tmp_base = nregs = nvars + nconsts;
+    ntmp = 0;
+
+    p->entry = ncode;
+    for (NodeId n = fn->node; n; n = nd(n)->next)
+    {
+        lower_stmt(n);
+    }
+    emit(OP_END, 0, 0, 0);
+
+    p->nparams = fn->nparams;
+    p->nvars = nvars;
+    p->consts = consts;
+    p->nconsts = nconsts;
+    p->nregs = nregs;
+}
+
+long interp(Function *prog)
+{
+    // 呼び出されない関数は変換しない
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        if (is_live(fn))
+        {
+            procs = realloc(procs, sizeof(*procs) * (nprocs + 1));
+            procs[nprocs++] = (Proc){fn};
+        }
+    }
+
+    Proc *main = NULL;
+    for (int i = 0; i < nprocs; i++)
+    {
+        lower_func(&procs[i]);
+        if (!strcmp(procs[i].fn->name, "main"))
+        {
+            main = &procs[i];
+        }
+    }
+
+    long *r = calloc(REG_STACK_SIZE, sizeof(long));
+    memcpy(r + main->nvars, main->consts, sizeof(long) * main->nconsts);
+    return run(code + main->entry, r);
+}
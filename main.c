@@ -1,15 +1,61 @@
 #include "orecc.h"
 
+char *opt_profile;
+bool opt_g;
+bool opt_rotate_loops = true;
+int opt_align_loops = 16;
+int opt_align_loops_skip = 10;
+int opt_level = 1;
+bool opt_pass_stats;
+char *opt_print_after;
+int opt_unroll_budget = 64;
+int opt_lex_threads = 1;
+char *input_path = "<command-line>";
+
 /**
- * @brief TODO
+ * @brief ファイルの内容を読み込む
  *
- * @param n
- * @param align
- * @return int
+ * @param path ファイルのパス。"-"の場合は標準入力から読み込む
+ * @return ファイルの内容の文字列
  */
-static int align_to(int n, int align)
+static char *read_file(char *path)
 {
-    return (n + align - 1) & ~(align - 1);
+    FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!fp)
+    {
+        error("cannot open %s", path);
+    }
+
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+
+    for (;;)
+    {
+        char buf2[4096];
+        size_t n = fread(buf2, 1, sizeof(buf2), fp);
+        if (n == 0)
+        {
+            break;
+        }
+        fwrite(buf2, 1, n, out);
+    }
+
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+    fflush(out);
+    fputc('\0', out);
+    fclose(out);
+    return buf;
+}
+
+static void usage(char *argv0)
+{
+    error("usage: %s [-O<level>] [-f[no-]pass=<name>] [--print-after=<name>] [--pass-stats] [-funroll-budget=<n>] [-flex-threads=<n>] [-g] [-fno-rotate-loops] [-falign-loops=<n>[:<max-skip>]] [-fprofile-counters[=<file>]] "
+          "[--annotate[=<file>]] [--interp] [-f <file>] [<program>]",
+          argv0);
 }
 
 /**
@@ -17,22 +63,183 @@ static int align_to(int n, int align)
  */
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    char *input = NULL;
+    char *annotate_path = NULL;
+    bool run_interp = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        // -O<level>: 最適化レベルを指定する。-Oは-O1と同じ
+        if (!strncmp(argv[i], "-O", 2))
+        {
+            char *p = argv[i] + 2;
+            opt_level = *p ? strtol(p, &p, 10) : 1;
+            if (*p || opt_level < 0 || 2 < opt_level)
+            {
+                error("invalid optimization level: %s", argv[i]);
+            }
+            continue;
+        }
+
+        // -fpass=<name>, -fno-pass=<name>: 最適化レベルによらずパスを有効または無効にする
+        if (!strncmp(argv[i], "-fpass=", 7))
+        {
+            set_pass(argv[i] + 7, true);
+            continue;
+        }
+        if (!strncmp(argv[i], "-fno-pass=", 10))
+        {
+            set_pass(argv[i] + 10, false);
+            continue;
+        }
+
+        // --print-after=<name>: パスの実行後のプログラムを出力する
+        if (!strncmp(argv[i], "--print-after=", 14))
+        {
+            opt_print_after = argv[i] + 14;
+            continue;
+        }
+
+        // --pass-stats: パスごとの実行時間と変更数を出力する
+        if (!strcmp(argv[i], "--pass-stats"))
+        {
+            opt_pass_stats = true;
+            continue;
+        }
+
+        // -funroll-budget=<n>: ループの展開で増やしてよいノード数を指定する。0で展開しない
+        if (!strncmp(argv[i], "-funroll-budget=", 16))
+        {
+            char *p = argv[i] + 16;
+            opt_unroll_budget = strtol(p, &p, 10);
+            if (*p || p == argv[i] + 16 || opt_unroll_budget < 0)
+            {
+                error("invalid unroll budget: %s", argv[i]);
+            }
+            continue;
+        }
+
+        // -flex-threads=<n>: 入力をn個の区間に分けて並列に字句解析する
+        if (!strncmp(argv[i], "-flex-threads=", 14))
+        {
+            char *p = argv[i] + 14;
+            opt_lex_threads = strtol(p, &p, 10);
+            if (*p || p == argv[i] + 14 || opt_lex_threads < 1)
+            {
+                error("invalid number of lexer threads: %s", argv[i]);
+            }
+            continue;
+        }
+
+        // -fno-rotate-loops: ループの条件判定を先頭に置いたままにする
+        if (!strcmp(argv[i], "-fno-rotate-loops"))
+        {
+            opt_rotate_loops = false;
+            continue;
+        }
+
+        // -falign-loops=<n>[:<max-skip>]: ループの先頭をnバイト境界に揃える。
+        // 揃えるためのパディングがmax-skipバイトを超える場合は揃えない
+        if (!strncmp(argv[i], "-falign-loops=", 14))
+        {
+            char *p = argv[i] + 14;
+            opt_align_loops = strtol(p, &p, 10);
+            opt_align_loops_skip = opt_align_loops - 1;
+            bool bad_skip = false;
+            if (*p == ':')
+            {
+                // 空や負のmax-skipは受け付けない
+                bad_skip = !isdigit((unsigned char)p[1]);
+                opt_align_loops_skip = strtol(p + 1, &p, 10);
+            }
+            if (*p || bad_skip || opt_align_loops < 0 || (opt_align_loops & (opt_align_loops - 1)))
+            {
+                error("invalid loop alignment: %s", argv[i]);
+            }
+            continue;
+        }
+
+        // -fprofile-counters[=<file>]: 基本ブロックの実行回数を計測するコードを出力する
+        if (!strcmp(argv[i], "-fprofile-counters"))
+        {
+            opt_profile = "orecc.prof";
+            continue;
+        }
+        if (!strncmp(argv[i], "-fprofile-counters=", 19))
+        {
+            opt_profile = argv[i] + 19;
+            continue;
+        }
+
+        // --annotate[=<file>]: 計測結果をプログラムに添えて出力する
+        if (!strcmp(argv[i], "--annotate"))
+        {
+            annotate_path = "orecc.prof";
+            continue;
+        }
+        if (!strncmp(argv[i], "--annotate=", 11))
+        {
+            annotate_path = argv[i] + 11;
+            continue;
+        }
+
+        // --interp: アセンブリを出力せず、バイトコードに変換して実行する
+        if (!strcmp(argv[i], "--interp"))
+        {
+            run_interp = true;
+            continue;
+        }
+
+        // -f <file>: ファイルからプログラムを読み込む
+        if (!strcmp(argv[i], "-f"))
+        {
+            if (++i == argc)
+            {
+                usage(argv[0]);
+            }
+            input = read_file(argv[i]);
+            input_path = argv[i];
+            continue;
+        }
+
+        // -g: デバッグ情報を出力する
+        if (!strcmp(argv[i], "-g"))
+        {
+            opt_g = true;
+            continue;
+        }
+
+        // それ以外の引数はプログラムそのもの
+        if (input)
+        {
+            error("%s: invalid number of arguments", argv[0]);
+        }
+        input = argv[i];
+    }
+
+    if (!input)
     {
-        error("%s: invalid number of arguments", argv[0]);
+        usage(argv[0]);
     }
 
-    Token *tok = tokenize(argv[1]);
-    Function *prog = parse(tok);
+    if (annotate_path)
+    {
+        annotate(input, annotate_path);
+        return 0;
+    }
+
+    // パーサの要求に応じて逐次字句解析する。-flex-threadsの場合は先に全体を並列に字句解析する
+    TokenBuf *buf = opt_lex_threads > 1 ? tokenize_parallel(input, opt_lex_threads) : lex_open(input);
+    Function *prog = parse(buf);
+
+    // 最適化レベルに応じたパスを実行し、ローカル変数の領域を確保する
+    run_passes(prog);
 
-    // ローカル変数の領域確保
-    int offset = 32; // 32 for callee-saved registers
-    for (Var *var = prog->locals; var; var = var->next)
+    // --interpの場合はバイトコードを実行し、戻り値を終了ステータスとして返す
+    if (run_interp)
     {
-        offset += 8;
-        var->offset = offset;
+        return (int)interp(prog);
     }
-    prog->stack_size = align_to(offset, 16); // TODO: what is this process
 
     // ASTをさかのぼってアセンブリを出力する
     codegen(prog);
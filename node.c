@@ -0,0 +1,277 @@
+#include "orecc.h"
+
+// ノードプール。NODE_CHUNK個ずつ確保したチャンクを並べ、生成済みノードのアドレスを固定する
+Node **node_chunks;
+static int nchunks;
+static int chunks_cap;
+
+// 次に割り当てるノードのインデックス。0番はノードなしを表すため使用しない
+static NodeId nnodes = 1;
+
+NodeId new_node(NodeKind kind, int loc)
+{
+    NodeId id = nnodes++;
+    if ((id >> NODE_CHUNK_BITS) == nchunks)
+    {
+        if (nchunks == chunks_cap)
+        {
+            chunks_cap = chunks_cap ? chunks_cap * 2 : 16;
+            node_chunks = realloc(node_chunks, sizeof(*node_chunks) * chunks_cap);
+        }
+        node_chunks[nchunks++] = calloc(NODE_CHUNK, sizeof(Node));
+    }
+
+    Node *node = nd(id);
+    node->kind = kind;
+    node->loc = loc;
+    return id;
+}
+
+NodeId new_binary(NodeKind kind, NodeId lhs, NodeId rhs, int loc)
+{
+    NodeId id = new_node(kind, loc);
+    Node *node = nd(id);
+    node->lhs = lhs;
+    node->rhs = rhs;
+    return id;
+}
+
+NodeId new_unary(NodeKind kind, NodeId expr, int loc)
+{
+    NodeId id = new_node(kind, loc);
+    nd(id)->lhs = expr;
+    return id;
+}
+
+NodeId new_num(long val, int loc)
+{
+    NodeId id = new_node(ND_NUM, loc);
+    nd(id)->val = val;
+    return id;
+}
+
+NodeId new_var_node(Var *var, int loc)
+{
+    NodeId id = new_node(ND_VAR, loc);
+    nd(id)->var = var;
+    return id;
+}
+
+void replace_node(NodeId id, NodeId with)
+{
+    NodeId next = nd(id)->next;
+    *nd(id) = *nd(with);
+    nd(id)->next = next;
+}
+
+NodeId copy_tree(NodeId id)
+{
+    if (!id)
+    {
+        return 0;
+    }
+
+    NodeId copy = new_node(nd(id)->kind, nd(id)->loc);
+    Node *node = nd(copy);
+    *node = *nd(id);
+    node->next = 0;
+
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return copy;
+    case ND_IF:
+    case ND_FOR:
+    case ND_SELECT:
+    {
+        NodeId cond = copy_tree(node->cond);
+        NodeId then = copy_tree(node->then);
+        NodeId els = copy_tree(node->els);
+        NodeId init = copy_tree(node->init);
+        NodeId inc = copy_tree(node->inc);
+        node->cond = cond;
+        node->then = then;
+        node->els = els;
+        node->init = init;
+        node->inc = inc;
+        return copy;
+    }
+    case ND_BLOCK:
+    case ND_FUNCALL:
+    {
+        // 文の並びと引数の並びはどちらも先頭のノードからnextでつなぐ
+        NodeId head = 0;
+        NodeId *cur = &head;
+        for (NodeId n = node->kind == ND_BLOCK ? nd(id)->body : nd(id)->args; n; n = nd(n)->next)
+        {
+            *cur = copy_tree(n);
+            cur = &nd(*cur)->next;
+        }
+        if (node->kind == ND_BLOCK)
+        {
+            node->body = head;
+        }
+        else
+        {
+            node->args = head;
+        }
+        return copy;
+    }
+    default:
+    {
+        NodeId lhs = copy_tree(node->lhs);
+        NodeId rhs = copy_tree(node->rhs);
+        node->lhs = lhs;
+        node->rhs = rhs;
+        return copy;
+    }
+    }
+}
+
+Var *new_local(Function *prog, char *name)
+{
+    Var *var = calloc(1, sizeof(Var));
+    var->name = name;
+    var->id = prog->locals ? prog->locals->id + 1 : 0;
+    var->next = prog->locals;
+    prog->locals = var;
+    return var;
+}
+
+int count_nodes(NodeId id)
+{
+    if (!id)
+    {
+        return 0;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return 1;
+    case ND_IF:
+    case ND_FOR:
+    case ND_SELECT:
+        return 1 + count_nodes(node->init) + count_nodes(node->cond) + count_nodes(node->then) +
+               count_nodes(node->els) + count_nodes(node->inc);
+    case ND_BLOCK:
+    case ND_FUNCALL:
+    {
+        int n = 1;
+        for (NodeId s = node->kind == ND_BLOCK ? node->body : node->args; s; s = nd(s)->next)
+        {
+            n += count_nodes(s);
+        }
+        return n;
+    }
+    default:
+        return 1 + count_nodes(node->lhs) + count_nodes(node->rhs);
+    }
+}
+
+int node_count(void)
+{
+    return nnodes;
+}
+
+bool is_assigned(NodeId id, Var *var)
+{
+    if (!id)
+    {
+        return false;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return false;
+    case ND_ASSIGN:
+        if (nd(node->lhs)->kind == ND_VAR && nd(node->lhs)->var == var)
+        {
+            return true;
+        }
+        return is_assigned(node->lhs, var) || is_assigned(node->rhs, var);
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        return is_assigned(node->lhs, var);
+    case ND_IF:
+    case ND_SELECT:
+        return is_assigned(node->cond, var) || is_assigned(node->then, var) || is_assigned(node->els, var);
+    case ND_FOR:
+        return is_assigned(node->init, var) || is_assigned(node->cond, var) || is_assigned(node->inc, var) ||
+               is_assigned(node->then, var);
+    case ND_BLOCK:
+    case ND_FUNCALL:
+        for (NodeId n = node->kind == ND_BLOCK ? node->body : node->args; n; n = nd(n)->next)
+        {
+            if (is_assigned(n, var))
+            {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return is_assigned(node->lhs, var) || is_assigned(node->rhs, var);
+    }
+}
+
+bool is_pure(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return true;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_UDIV:
+    case ND_SHR:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return is_pure(node->lhs) && is_pure(node->rhs);
+    case ND_SELECT:
+        return is_pure(node->cond) && is_pure(node->then) && is_pure(node->els);
+    default:
+        return false;
+    }
+}
+
+bool may_trap(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return false;
+    case ND_DIV:
+    case ND_UDIV:
+        if (nd(node->rhs)->kind != ND_NUM || nd(node->rhs)->val == 0 || (node->kind == ND_DIV && nd(node->rhs)->val == -1))
+        {
+            return true;
+        }
+        return may_trap(node->lhs);
+    case ND_FUNCALL:
+        // 呼び出し先で0除算が起きたり、呼び出しから戻らなかったりしうる
+        return true;
+    case ND_SELECT:
+        return may_trap(node->cond) || may_trap(node->then) || may_trap(node->els);
+    default:
+        return may_trap(node->lhs) || may_trap(node->rhs);
+    }
+}
+
+bool is_removable(NodeId id)
+{
+    return is_pure(id) && !may_trap(id);
+}
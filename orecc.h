@@ -1,6 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -38,37 +39,64 @@ typedef enum
 } TokenKind;
 
 /**
- * @brief トークン
+ * @brief トークン列
+ *
+ * トークンの各属性を1つの伸長可能なバッファ上の並列配列に格納する。
+ * トークンはバッファ内のインデックスで参照する。
+ * ストリーミング時は並列配列を大きさLEX_RINGのリングバッファとして使い、
+ * パーサが参照したトークンまで必要に応じて字句解析を進める。
  */
-typedef struct Token Token;
-struct Token
+typedef struct TokenBuf TokenBuf;
+struct TokenBuf
 {
     /**
-     * @brief トークンの型
+     * @brief トークンの型 (TokenKind)
+     */
+    unsigned char *kind;
+
+    /**
+     * @brief 入力文字列の先頭からのトークンの位置
      */
-    TokenKind kind;
+    int *loc;
 
     /**
-     * @brief 次の入力トークン
+     * @brief トークンの長さ
      */
-    Token *next;
+    int *len;
 
     /**
      * @brief kindがTK_NUMの場合、その数値
      */
-    long val;
+    long *val;
 
     /**
-     * @brief トークンの位置
+     * @brief トークン数
      */
-    char *loc;
+    int n;
 
     /**
-     * @brief トークンの長さ
+     * @brief 確保済みのトークン数
      */
-    int len;
+    int cap;
+
+    /**
+     * @brief トークンのインデックスから並列配列上の位置を求めるマスク。
+     * リングバッファの場合はcap - 1、全トークンを保持する場合は-1
+     */
+    int mask;
+
+    /**
+     * @brief 次に字句解析する入力位置
+     */
+    char *p;
 };
 
+/**
+ * @brief ストリーミング時のリングバッファの大きさ (2の累乗)。
+ * パーサが参照できる過去のトークン数の上限になる。
+ */
+#define LEX_RING 16
+
 /**
  * @brief エラーを報告する。printfと同じ引数を取る。
  * @param fmt フォーマット
@@ -78,37 +106,121 @@ void error(char *fmt, ...);
 /**
  * @brief エラーの報告とプログラムの終了
  *
- * @param tok トークン列のポインタ
+ * @param tok トークンのインデックス
  * @param fmt 可変長フォーマット列
  */
-void error_tok(Token *tok, char *fmt, ...);
+void error_tok(int tok, char *fmt, ...);
+
+/**
+ * @brief ソースコード上の位置を示してエラーを報告し、プログラムを終了する。
+ * トークンを参照できなくなった後で、ノードの位置を使って報告する場合に使う
+ *
+ * @param loc 入力文字列の先頭からの位置
+ * @param fmt エラーメッセージの書式
+ * @param ... 書式の引数
+ */
+void error_loc(int loc, char *fmt, ...);
+
+/**
+ * @brief トークンの型を取得する
+ *
+ * @param tok トークンのインデックス
+ * @return トークンの型
+ */
+TokenKind tok_kind(int tok);
+
+/**
+ * @brief トークンの文字列の先頭を指すポインタを取得する
+ *
+ * @param tok トークンのインデックス
+ * @return トークン文字列のポインタ
+ */
+char *tok_loc(int tok);
+
+/**
+ * @brief 入力文字列の先頭からのトークンの位置を取得する
+ *
+ * @param tok トークンのインデックス
+ * @return トークンの位置
+ */
+int tok_offset(int tok);
+
+/**
+ * @brief トークンの長さを取得する
+ *
+ * @param tok トークンのインデックス
+ * @return トークン文字列の長さ
+ */
+int tok_len(int tok);
+
+/**
+ * @brief TK_NUMのトークンの数値を取得する
+ *
+ * @param tok トークンのインデックス
+ * @return トークンの数値
+ */
+long tok_val(int tok);
 
 /**
  * @brief 現在のトークンの文字列がopと一致しているか判定する
  *
- * @param tok トークン
+ * @param tok トークンのインデックス
  * @param op 比較対象文字列のポインタ
  * @return 一致している場合true, それ以外の場合はfalse
  */
-bool equal(Token *tok, char *op);
+bool equal(int tok, char *op);
 
 /**
- * @brief 現在のトークンの文字列がopであること判定し、次のトークンのポインタを取得する。
+ * @brief 現在のトークンの文字列がopであること判定し、次のトークンのインデックスを取得する。
  * トークン文字列がopでない場合、エラーを表示してプログラムを終了する。
  *
- * @param tok 現在のトークン
+ * @param tok 現在のトークンのインデックス
  * @param op 比較対象文字列のポインタ
- * @return Token* 次のトークンのポインタ。
+ * @return 次のトークンのインデックス
+ */
+int skip(int tok, char *op);
+
+/**
+ * @brief ソースコード上の位置から行番号と桁番号を求める
+ *
+ * @param loc 入力文字列の先頭からの位置
+ * @param line 行番号 (1始まり) の格納先
+ * @param col 桁番号 (1始まり) の格納先
+ */
+void get_line_col(int loc, int *line, int *col);
+
+/**
+ * @brief 以降のトークン参照で使用するトークン列を設定する
+ *
+ * @param buf トークン列
+ */
+void set_token_buf(TokenBuf *buf);
+
+/**
+ * @brief 文字列全体をトークン列に変換する
+ *
+ * @param input トークン列に変換する文字列のポインタ
+ * @return 全トークンを保持するトークン列
  */
-Token *skip(Token *tok, char *op);
+TokenBuf *tokenize(char *input);
 
 /**
- * @brief 文字列をトークン構造体に変換する
+ * @brief 文字列をパーサの要求に応じて逐次字句解析するトークン列を生成する
  *
- * @param input トークン構造体に変換する文字列のポインタ
- * @return トークン構造体のポインタ
+ * @param input トークン列に変換する文字列のポインタ
+ * @return リングバッファ上のトークン列
  */
-Token *tokenize(char *input);
+TokenBuf *lex_open(char *input);
+
+/**
+ * @brief 文字列を空白文字または';'の位置で区間に分け、各区間を別々のスレッドで字句解析して結合する。
+ * 入力が小さい場合はlex_openと同じく逐次字句解析する。不正な文字はパーサがその位置に達したときに報告する
+ *
+ * @param input トークン列に変換する文字列のポインタ
+ * @param nthreads 使用するスレッドの最大数
+ * @return 全トークンを保持するトークン列
+ */
+TokenBuf *tokenize_parallel(char *input, int nthreads);
 
 //
 // parser.c
@@ -131,6 +243,11 @@ struct Var
      * @brief RBPからアクセス対象のローカル変数までのバイト数
      */
     int offset;
+
+    /**
+     * @brief 関数内での変数の通し番号 (0始まり)
+     */
+    int id;
 };
 
 /**
@@ -158,6 +275,16 @@ typedef enum
      */
     ND_DIV,
 
+    /**
+     * @brief 符号なしの除算。被除数が0以上で除数が正の場合にND_DIVの代わりに使う
+     */
+    ND_UDIV,
+
+    /**
+     * @brief 右シフト(>>)。0以上の値を2のべき乗の定数で割る場合にND_DIVの代わりに使う
+     */
+    ND_SHR,
+
     /**
      * @brief 等価(==)
      */
@@ -183,6 +310,17 @@ typedef enum
      */
     ND_ASSIGN,
 
+    /**
+     * @brief 関数呼び出し
+     */
+    ND_FUNCALL,
+
+    /**
+     * @brief 条件による値の選択 (cond ? then : els)。条件式と両方の値を評価してから選ぶため、
+     * どれも副作用がなく、値の式は例外を起こさない
+     */
+    ND_SELECT,
+
     /**
      * @brief return
      */
@@ -209,6 +347,11 @@ typedef enum
      */
     ND_EXPR_STMT,
 
+    /**
+     * @brief 文の並び
+     */
+    ND_BLOCK,
+
     /**
      * @brief 変数
      */
@@ -221,9 +364,18 @@ typedef enum
 } NodeKind;
 
 typedef struct Node Node;
+typedef struct Function Function;
+
+/**
+ * @brief ノードプール内のノードのインデックス。0はノードなしを表す
+ */
+typedef unsigned int NodeId;
 
 /**
  * @brief 抽象構文木のノードの型
+ *
+ * 子ノードはポインタではなくノードプール内の32bitインデックスで参照する。
+ * 種類ごとに使用するフィールドが異なるため、共用体で領域を共有する。
  */
 struct Node
 {
@@ -233,101 +385,571 @@ struct Node
     NodeKind kind;
 
     /**
-     * @brief 次のノードを指すポインタ
-     */
-    Node *next;
+     * @brief 次のノード
+     */
+    NodeId next;
+
+    /**
+     * @brief ノードに対応するソースコード上の位置 (入力文字列の先頭からのバイト数)
+     */
+    int loc;
+
+    union
+    {
+        /**
+         * @brief [演算子/代入/return/式文] 被演算子
+         */
+        struct
+        {
+            /**
+             * @brief 左辺
+             */
+            NodeId lhs;
+
+            /**
+             * @brief 右辺
+             */
+            NodeId rhs;
+        };
+
+        /**
+         * @brief [if/for/select] 制御構文の各部
+         */
+        struct
+        {
+            /**
+             * @brief [if/while/for/select] 条件式部分のノード
+             */
+            NodeId cond;
+
+            /**
+             * @brief [if/while/for] 条件式が真のときに実行するコードのノード。[select] 真のときの値
+             */
+            NodeId then;
+
+            /**
+             * @brief [if] 条件式が偽のときに実行するコードのノード。[select] 偽のときの値
+             */
+            NodeId els;
+
+            /**
+             * @brief [for] 初期化式部分のノード
+             */
+            NodeId init;
+
+            /**
+             * @brief [for] カウントの更新式部のノード
+             */
+            NodeId inc;
+        };
+
+        /**
+         * @brief [block] 文の並びの先頭のノード
+         */
+        NodeId body;
+
+        /**
+         * @brief [funcall] 関数呼び出し
+         */
+        struct
+        {
+            /**
+             * @brief 引数の式の並びの先頭のノード。引数はnextでつなぐ
+             */
+            NodeId args;
+
+            /**
+             * @brief 呼び出す関数
+             */
+            Function *func;
+        };
+
+        /**
+         * @brief 変数のポインタ。kindがND_VARの場合に使用。
+         */
+        Var *var;
+
+        /**
+         * @brief 整数の値。kindがND_NUMの場合に使用。
+         */
+        long val;
+    };
+};
 
+typedef struct LVar LVar;
+
+struct LVar
+{
     /**
-     * @brief 左辺
+     * @brief 次の変数の構造体のポインタ
      */
-    Node *lhs;
+    LVar *next;
 
     /**
-     * @brief 右辺
+     * @brief 変数名
      */
-    Node *rhs;
+    char *name;
 
     /**
-     * @brief [if/while/for] 条件式部分のノード
+     * @brief 名前の長さ
      */
-    Node *cond;
+    int len;
 
     /**
-     * @brief [if/while/for] 条件式が真のときに実行するコードのノード
+     * @brief RBPからのオフセット
      */
-    Node *then;
+    int offset;
+};
 
+struct Function
+{
     /**
-     * @brief [for] 初期化式部分のノード
+     * @brief 次の関数
      */
-    Node *init;
+    Function *next;
 
     /**
-     * @brief [for] カウントの更新式部のノード
+     * @brief 関数名
      */
-    Node *inc;
+    char *name;
 
     /**
-     * @brief [if] 条件式が偽のときに実行するコードのノード
+     * @brief 文の並びの先頭のノード
      */
-    Node *els;
+    NodeId node;
 
     /**
-     * @brief 変数のポインタ。kindがND_VARの場合に使用。
+     * @brief 引数の数。引数は番号が0からnparams - 1のローカル変数
      */
-    Var *var;
+    int nparams;
 
     /**
-     * @brief 整数の値。kindがND_NUMの場合に使用。
+     * @brief プログラム中でこの関数を呼び出している箇所の数。0の場合はmain以外出力しない
      */
-    long val;
-};
+    int ncalls;
 
-typedef struct LVar LVar;
+    /**
+     * @brief 定義済みの場合true。呼び出しが定義より前にある場合は、呼び出した時点で未定義の関数を作る
+     */
+    bool defined;
 
-struct LVar
-{
     /**
-     * @brief 次の変数の構造体のポインタ
+     * @brief インライン展開のパスを実行済みまたは実行中の場合true
      */
-    LVar *next;
+    bool inlined;
 
     /**
-     * @brief 変数名
+     * @brief インライン展開のパスを実行中の場合true。展開途中の本体は複製しない
      */
-    char *name;
+    bool inlining;
 
     /**
-     * @brief 名前の長さ
+     * @brief ローカル変数群
      */
-    int len;
+    Var *locals;
 
     /**
-     * @brief RBPからのオフセット
+     * @brief スタックサイズ(byte)
      */
-    int offset;
+    int stack_size;
 };
 
-typedef struct Function Function;
-struct Function
+/**
+ * @brief プログラムをパースする。関数定義の外にある文は暗黙のmain関数の本体とする
+ *
+ * @param buf トークン列
+ * @return 関数の並び
+ */
+Function *parse(TokenBuf *buf);
+
+/**
+ * @brief 関数が出力されるか判定する
+ *
+ * @param fn 関数
+ * @return mainまたはどこかから呼び出されている場合true
+ */
+bool is_live(Function *fn);
+
+//
+// node.c
+//
+
+#define NODE_CHUNK_BITS 12
+#define NODE_CHUNK (1 << NODE_CHUNK_BITS)
+
+extern Node **node_chunks;
+
+/**
+ * @brief ノードのインデックスからノードのポインタを得る。
+ * ノードプールはチャンク単位で確保するため、得たポインタはノードを追加しても無効にならない。
+ *
+ * @param id ノードのインデックス
+ * @return ノードのポインタ
+ */
+static inline Node *nd(NodeId id)
+{
+    return &node_chunks[id >> NODE_CHUNK_BITS][id & (NODE_CHUNK - 1)];
+}
+
+/**
+ * @brief ノードプールから新しいノードを割り当てる
+ *
+ * @param kind ノードの種類
+ * @param loc ソースコード上の位置
+ * @return 新しいノードのインデックス
+ */
+NodeId new_node(NodeKind kind, int loc);
+
+NodeId new_binary(NodeKind kind, NodeId lhs, NodeId rhs, int loc);
+NodeId new_unary(NodeKind kind, NodeId expr, int loc);
+NodeId new_num(long val, int loc);
+NodeId new_var_node(Var *var, int loc);
+
+/**
+ * @brief ノード以下の木を複製する。複製した木の根のnextは0にする
+ *
+ * @param id 複製するノード
+ * @return 複製した木の根
+ */
+NodeId copy_tree(NodeId id);
+
+/**
+ * @brief ノードの内容を別のノードの内容で置き換える。引数の並びをつなぐnextは元のまま残す
+ *
+ * @param id 置き換えるノード
+ * @param with 置き換える内容のノード
+ */
+void replace_node(NodeId id, NodeId with);
+
+/**
+ * @brief 関数にローカル変数を追加する。最適化パスが一時変数を作る際に使う
+ *
+ * @param prog 関数
+ * @param name 変数名
+ * @return 追加した変数
+ */
+Var *new_local(Function *prog, char *name);
+
+/**
+ * @brief ノード以下で変数に代入しているか判定する
+ *
+ * @param id ノード
+ * @param var 変数
+ * @return 代入している場合true
+ */
+bool is_assigned(NodeId id, Var *var);
+
+/**
+ * @brief 式が副作用を持たないか判定する
+ *
+ * @param id 式のノード
+ * @return 変数への代入などの副作用を含まない場合true
+ */
+bool is_pure(NodeId id);
+
+/**
+ * @brief 式が0除算などで例外を起こしうるか判定する
+ *
+ * @param id 式のノード
+ * @return 除数が0または-1になりうる除算を含む場合true
+ */
+bool may_trap(NodeId id);
+
+/**
+ * @brief 式の評価を省いても実行結果が変わらないか判定する
+ *
+ * @param id 式のノード
+ * @return 副作用がなく、例外も起こさない場合true
+ */
+bool is_removable(NodeId id);
+
+/**
+ * @brief ノード以下のノード数を数える。展開によるコードの大きさの目安に使う
+ */
+int count_nodes(NodeId id);
+
+/**
+ * @brief これまでに割り当てたノードのインデックスの上限を得る。
+ * ノードごとの情報を持つ表の大きさに使用する。
+ */
+int node_count(void);
+
+//
+// main.c
+//
+
+/**
+ * @brief -fprofile-counters で指定された計測結果の出力先。NULLの場合は計測しない
+ */
+extern char *opt_profile;
+
+/**
+ * @brief -g が指定された場合true。DWARFの行番号情報を出力する
+ */
+extern bool opt_g;
+
+/**
+ * @brief ループをローテートし、条件判定をループの末尾に置く場合true
+ */
+extern bool opt_rotate_loops;
+
+/**
+ * @brief ループの先頭のアライメント (バイト数)。1以下の場合は揃えない
+ */
+extern int opt_align_loops;
+
+/**
+ * @brief ループの先頭を揃えるために挿入するパディングの上限 (バイト数)
+ */
+extern int opt_align_loops_skip;
+
+/**
+ * @brief -O で指定された最適化レベル (0から2)
+ */
+extern int opt_level;
+
+/**
+ * @brief --pass-stats が指定された場合true。パスごとの実行時間と変更数を標準エラー出力に出力する
+ */
+extern bool opt_pass_stats;
+
+/**
+ * @brief --print-after で指定されたパスの名前。そのパスの実行後にプログラムを標準エラー出力に出力する
+ */
+extern char *opt_print_after;
+
+/**
+ * @brief -funroll-budget で指定された、1つのループの展開で増やしてよいノード数。0以下の場合は展開しない
+ */
+extern int opt_unroll_budget;
+
+/**
+ * @brief -flex-threads で指定された字句解析に使うスレッド数。1の場合は逐次字句解析する
+ */
+extern int opt_lex_threads;
+
+/**
+ * @brief 入力ファイルのパス。プログラムを引数で直接与えた場合は"<command-line>"
+ */
+extern char *input_path;
+
+//
+// profile.c
+//
+
+/**
+ * @brief 実行回数のカウンタを割り当てる
+ *
+ * @param loc カウンタに対応するソースコード上の位置
+ * @return カウンタの番号。計測しない場合は-1
+ */
+int prof_counter(int loc);
+
+/**
+ * @brief カウンタを加算するコードを出力する。
+ * 同じソースコードに対応する複数の基本ブロックで1つのカウンタを共有する場合に使う。
+ *
+ * @param idx prof_counterで割り当てたカウンタの番号
+ */
+void prof_inc(int idx);
+
+/**
+ * @brief 基本ブロックの先頭で実行回数のカウンタを加算するコードを出力する
+ *
+ * @param loc 基本ブロックに対応するソースコード上の位置
+ */
+void prof_count(int loc);
+
+/**
+ * @brief プログラムの終了時にカウンタを計測結果ファイルへ書き出すコードを出力する
+ */
+void prof_emit_dump(void);
+
+/**
+ * @brief カウンタとカウンタの位置の表を出力する
+ */
+void prof_emit_data(void);
+
+/**
+ * @brief 計測結果に従って、入力したプログラムに実行回数を添えて出力する
+ *
+ * @param input プログラムの文字列
+ * @param path 計測結果ファイルのパス
+ */
+void annotate(char *input, char *path);
+
+//
+// inline.c
+//
+
+/**
+ * @brief 小さな関数と呼び出し箇所が1つだけの関数の呼び出しを、関数の本体で置き換える。
+ * 呼び出し先は先に展開する
+ *
+ * @param prog 関数
+ * @return 展開した呼び出しの数
+ */
+int inliner(Function *prog);
+
+//
+// scev.c
+//
+
+/**
+ * @brief 繰り返し回数がコンパイル時に定まるforループの情報
+ */
+typedef struct
 {
     /**
-     * @brief 現在のノード
+     * @brief 帰納変数
      */
-    Node *node;
+    Var *iv;
 
     /**
-     * @brief ローカル変数群
+     * @brief 帰納変数の初期値
      */
-    Var *locals;
+    long start;
 
     /**
-     * @brief スタックサイズ(byte)
+     * @brief 1回の繰り返しでの帰納変数の増分
      */
-    int stack_size;
-};
+    long step;
+
+    /**
+     * @brief 繰り返し回数
+     */
+    unsigned long trip;
 
-Function *parse(Token *tok);
+    /**
+     * @brief ループ終了時の帰納変数の値
+     */
+    long final;
+} CountedLoop;
+
+/**
+ * @brief for (iv = 定数; iv < 定数; iv = iv + 定数) の形のループの繰り返し回数を求める。
+ * 帰納変数はループ本体で代入されていてはならない。
+ *
+ * @param node forループのノード
+ * @param loop 解析結果の格納先
+ * @return 繰り返し回数が定まる場合true
+ */
+bool counted_loop(Node *node, CountedLoop *loop);
+
+/**
+ * @brief 帰納変数の多項式を足し込むだけのループを、ループ終了時の値を直接求める代入に置き換える
+ *
+ * @param prog プログラム
+ * @return 置き換えたループの数
+ */
+int scev(Function *prog);
+
+//
+// unroll.c
+//
+
+/**
+ * @brief 繰り返し回数が定まる小さなループを完全に展開し、繰り返し回数が実行時に決まるループは
+ * 本体を複数回並べたループと残りの繰り返しを行うループに分ける
+ *
+ * @param prog プログラム
+ * @return 展開したループの数
+ */
+int unroll(Function *prog);
+
+//
+// reassoc.c
+//
+
+/**
+ * @brief 加減算と乗算の連鎖を、定数をまとめた上で互いに依存しない部分和(部分積)の木に組み直す
+ *
+ * @param prog プログラム
+ * @return 組み直した式の数
+ */
+int reassoc(Function *prog);
+
+//
+// vrp.c
+//
+
+/**
+ * @brief 分岐とループを通して変数の値の範囲を求め、結果が決まる比較と分岐を取り除き、
+ * 0以上の値の除算を符号なし除算やシフトに置き換える
+ *
+ * @param prog プログラム
+ * @return 書き換えたノードの数
+ */
+int vrp(Function *prog);
+
+//
+// cse.c
+//
+
+/**
+ * @brief 値番号付けにより、既に求めた式の値を一時変数に保持して再利用する
+ *
+ * @param prog プログラム
+ * @return 置き換えた式の数
+ */
+int cse(Function *prog);
+
+//
+// ifcvt.c
+//
+
+/**
+ * @brief 同じ変数に小さな値を代入するだけのif文や、小さな値を返すだけのif文を、
+ * 分岐のない値の選択に置き換える
+ *
+ * @param prog プログラム
+ * @return 置き換えたif文の数
+ */
+int ifcvt(Function *prog);
+
+//
+// dse.c
+//
+
+/**
+ * @brief 生存変数解析により、以降で読まれない変数への代入と副作用のない式文を取り除き、
+ * 参照されなくなった変数をローカル変数から外す
+ *
+ * @param prog プログラム
+ * @return 取り除いた代入、文、変数の数
+ */
+int dse(Function *prog);
+
+//
+// interp.c
+//
+
+/**
+ * @brief プログラムをバイトコードに変換してインタプリタで実行する
+ *
+ * @param prog プログラム
+ * @return プログラムの戻り値
+ */
+long interp(Function *prog);
+
+//
+// pass.c
+//
+
+/**
+ * @brief 最適化レベルによらずパスを有効または無効にする
+ *
+ * @param name パスの名前
+ * @param enable 有効にする場合true
+ */
+void set_pass(char *name, bool enable);
+
+/**
+ * @brief 有効なパスを順に実行する
+ *
+ * @param prog プログラム
+ */
+void run_passes(Function *prog);
 
 //
 // codegen.c
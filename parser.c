@@ -1,28 +1,43 @@
 #include "orecc.h"
 
-// パース中に生成されたすべてのローカル変数インスタンス
+// パース中の関数のローカル変数
 Var *locals;
 
-static Node *expr(Token **rest, Token *tok);
-static Node *assign(Token **rest, Token *tok);
-static Node *equality(Token **rest, Token *tok);
-static Node *relational(Token **rest, Token *tok);
-static Node *add(Token **rest, Token *tok);
-static Node *mul(Token **rest, Token *tok);
-static Node *unary(Token **rest, Token *tok);
-static Node *primary(Token **rest, Token *tok);
+// 定義または呼び出しで現れた関数の並び
+static Function *functions;
+static Function **functions_tail = &functions;
+
+// 呼び出しより後で定義される関数の呼び出し。引数の数はパースの最後に確かめる
+typedef struct
+{
+    Function *func;
+    int nargs;
+    int loc;
+} PendingCall;
+
+static PendingCall *pending;
+static int npending;
+static int pending_cap;
+
+// 関数の引数の最大数。引数はすべてレジスタで渡す
+#define MAX_PARAMS 6
+
+static NodeId expr(int *rest, int tok);
+static NodeId primary(int *rest, int tok);
 
 /**
  * @brief トークンの文字列からローカル変数のポインタを得る
  *
- * @param tok トークンのポインタ
+ * @param tok トークンのインデックス
  * @return 変数構造体のポインタ。トークン文字列に一致する名前の変数がない場合NULL。
  */
-static Var *find_var(Token *tok)
+static Var *find_var(int tok)
 {
+    char *loc = tok_loc(tok);
+    int len = tok_len(tok);
     for (Var *var = locals; var; var = var->next)
     {
-        if (strlen(var->name) == tok->len && !strncmp(tok->loc, var->name, tok->len))
+        if (!strncmp(loc, var->name, len) && var->name[len] == '\0')
         {
             return var;
         }
@@ -30,58 +45,51 @@ static Var *find_var(Token *tok)
     return NULL;
 }
 
-static Node *new_node(NodeKind kind)
-{
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = kind;
-    return node;
-}
-
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs)
-{
-    Node *node = new_node(kind);
-    node->lhs = lhs;
-    node->rhs = rhs;
-    return node;
-}
-
-static Node *new_unary(NodeKind kind, Node *expr)
+static Var *new_lvar(char *name)
 {
-    Node *node = new_node(kind);
-    node->lhs = expr;
-    return node;
+    Var *var = calloc(1, sizeof(Var));
+    var->name = name;
+    var->id = locals ? locals->id + 1 : 0;
+    var->next = locals;
+    locals = var;
+    return var;
 }
 
-static Node *new_num(long val)
+/**
+ * @brief 関数名から関数を得る。まだ現れていない関数の場合は未定義の関数を作る
+ *
+ * @param name 関数名
+ * @param len 関数名の長さ
+ */
+static Function *find_func(char *name, int len)
 {
-    Node *node = new_node(ND_NUM);
-    node->val = val;
-    return node;
-}
+    for (Function *fn = functions; fn; fn = fn->next)
+    {
+        if (!strncmp(fn->name, name, len) && fn->name[len] == '\0')
+        {
+            return fn;
+        }
+    }
 
-static Node *new_var_node(Var *var)
-{
-    Node *node = new_node(ND_VAR);
-    node->var = var;
-    return node;
+    Function *fn = calloc(1, sizeof(Function));
+    fn->name = strndup(name, len);
+    *functions_tail = fn;
+    functions_tail = &fn->next;
+    return fn;
 }
 
-static Var *new_lvar(char *name)
+bool is_live(Function *fn)
 {
-    Var *var = calloc(1, sizeof(Var));
-    var->name = name;
-    var->next = locals;
-    locals = var;
-    return var;
+    return fn->ncalls > 0 || !strcmp(fn->name, "main");
 }
 
-static long get_number(Token *tok)
+static long get_number(int tok)
 {
-    if (tok->kind != TK_NUM)
+    if (tok_kind(tok) != TK_NUM)
     {
         error_tok(tok, "expected a number");
     }
-    return tok->val;
+    return tok_val(tok);
 }
 
 /**
@@ -90,40 +98,45 @@ static long get_number(Token *tok)
  *      | "if" "(" expr ")" stmt ("else" stmt)?
  *      | "for" "(" expr? ";" expr? ";" expr? ")" stmt
  *      | "while" "(" expr ")" stmt
+ *      | "{" stmt* "}"
  */
-static Node *stmt(Token **rest, Token *tok)
+static NodeId stmt(int *rest, int tok)
 {
+    int loc = tok_offset(tok);
+
     if (equal(tok, "return"))
     {
-        Node *node = new_unary(ND_RETURN, expr(&tok, tok->next));
+        NodeId node = new_unary(ND_RETURN, expr(&tok, tok + 1), loc);
         *rest = skip(tok, ";");
         return node;
     }
 
     if (equal(tok, "if"))
     {
-        Node *node = new_node(ND_IF);
-        tok = skip(tok->next, "(");
+        NodeId id = new_node(ND_IF, loc);
+        Node *node = nd(id);
+        tok = skip(tok + 1, "(");
         node->cond = expr(&tok, tok);
         tok = skip(tok, ")");
         node->then = stmt(&tok, tok);
         if (equal(tok, "else"))
         {
-            node->els = stmt(&tok, tok->next);
+            node->els = stmt(&tok, tok + 1);
         }
         *rest = tok;
-        return node;
+        return id;
     }
 
     if (equal(tok, "for"))
     {
-        Node *node = new_node(ND_FOR);
-        tok = skip(tok->next, "(");
+        NodeId id = new_node(ND_FOR, loc);
+        Node *node = nd(id);
+        tok = skip(tok + 1, "(");
 
         // 初期化式の有無
         if (!equal(tok, ";"))
         {
-            node->init = new_unary(ND_EXPR_STMT, expr(&tok, tok));
+            node->init = new_unary(ND_EXPR_STMT, expr(&tok, tok), tok_offset(tok));
         }
         tok = skip(tok, ";");
 
@@ -137,220 +150,484 @@ static Node *stmt(Token **rest, Token *tok)
         // カウンタ変数の更新式の有無
         if (!equal(tok, ")"))
         {
-            node->inc = new_unary(ND_EXPR_STMT, expr(&tok, tok));
+            node->inc = new_unary(ND_EXPR_STMT, expr(&tok, tok), tok_offset(tok));
         }
         tok = skip(tok, ")");
 
         // 実行部
         node->then = stmt(rest, tok);
-        return node;
+        return id;
     }
 
     if (equal(tok, "while"))
     {
-        Node *node = new_node(ND_FOR);
-        tok = skip(tok->next, "(");
+        NodeId id = new_node(ND_FOR, loc);
+        Node *node = nd(id);
+        tok = skip(tok + 1, "(");
         node->cond = expr(&tok, tok);
         tok = skip(tok, ")");
         node->then = stmt(rest, tok);
-        return node;
+        return id;
+    }
+
+    if (equal(tok, "{"))
+    {
+        NodeId id = new_node(ND_BLOCK, loc);
+        NodeId *cur = &nd(id)->body;
+        tok = tok + 1;
+        while (!equal(tok, "}"))
+        {
+            *cur = stmt(&tok, tok);
+            cur = &nd(*cur)->next;
+        }
+        *rest = tok + 1;
+        return id;
     }
 
-    Node *node = new_unary(ND_EXPR_STMT, expr(&tok, tok));
+    NodeId node = new_unary(ND_EXPR_STMT, expr(&tok, tok), loc);
     *rest = skip(tok, ";");
     return node;
 }
 
-// expr = assign
-static Node *expr(Token **rest, Token *tok)
+/**
+ * @brief 二項演算子の結合力表の要素
+ */
+typedef struct
 {
-    return assign(rest, tok);
+    /**
+     * @brief 演算子の文字列
+     */
+    char *op;
+
+    /**
+     * @brief 生成するノードの種類
+     */
+    NodeKind kind;
+
+    /**
+     * @brief 結合力。大きいほど強く結合する
+     */
+    int prec;
+
+    /**
+     * @brief 右結合の場合true
+     */
+    bool right;
+
+    /**
+     * @brief 左辺と右辺を入れ替えてノードを生成する場合true (">" を "<" として扱う等)
+     */
+    bool swap;
+} BinOp;
+
+// 二項演算子の結合力表
+static BinOp binops[] = {
+    {"=", ND_ASSIGN, 1, true, false},
+    {"==", ND_EQ, 2, false, false},
+    {"!=", ND_NE, 2, false, false},
+    {"<", ND_LT, 3, false, false},
+    {"<=", ND_LE, 3, false, false},
+    {">", ND_LT, 3, false, true},
+    {">=", ND_LE, 3, false, true},
+    {"+", ND_ADD, 4, false, false},
+    {"-", ND_SUB, 4, false, false},
+    {"*", ND_MUL, 5, false, false},
+    {"/", ND_DIV, 5, false, false},
+};
+
+// 演算子スタックに積む前置演算子と開き括弧の目印
+static BinOp neg_op = {"-", ND_SUB, 0, false, false};
+static BinOp paren_op = {"(", ND_ADD, 0, false, false};
+
+// 演算子スタックと被演算子スタック。式のネストの深さに応じて伸長する
+static BinOp **ops;
+static int *ops_loc;
+static int ops_len, ops_cap;
+static NodeId *vals;
+static int vals_len, vals_cap;
+
+static void push_op(BinOp *op, int loc)
+{
+    if (ops_len == ops_cap)
+    {
+        ops_cap = ops_cap ? ops_cap * 2 : 64;
+        ops = realloc(ops, sizeof(*ops) * ops_cap);
+        ops_loc = realloc(ops_loc, sizeof(*ops_loc) * ops_cap);
+    }
+    ops_loc[ops_len] = loc;
+    ops[ops_len++] = op;
 }
 
-// assign = equality ("=" assign)?
-static Node *assign(Token **rest, Token *tok)
+static void push_val(NodeId node)
 {
-    Node *node = equality(&tok, tok);
-    if (equal(tok, "="))
+    if (vals_len == vals_cap)
     {
-        node = new_binary(ND_ASSIGN, node, assign(&tok, tok->next));
+        vals_cap = vals_cap ? vals_cap * 2 : 64;
+        vals = realloc(vals, sizeof(*vals) * vals_cap);
     }
-    *rest = tok;
-    return node;
+    vals[vals_len++] = node;
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-static Node *equality(Token **rest, Token *tok)
+/**
+ * @brief トークンに対応する二項演算子を結合力表から引く
+ *
+ * @param tok トークンのインデックス
+ * @return 二項演算子。トークンが二項演算子でない場合NULL
+ */
+static BinOp *find_binop(int tok)
 {
-    Node *node = relational(&tok, tok);
+    if (tok_kind(tok) != TK_RESERVED || tok_len(tok) > 2)
+    {
+        return NULL;
+    }
 
-    for (;;)
+    char *loc = tok_loc(tok);
+    char c = loc[0];
+    bool eq = tok_len(tok) == 2 && loc[1] == '=';
+    if (tok_len(tok) == 2 && !eq)
     {
-        if (equal(tok, "=="))
-        {
-            Node *rhs = relational(&tok, tok->next);
-            node = new_binary(ND_EQ, node, rhs);
-            continue;
-        }
+        return NULL;
+    }
 
-        if (equal(tok, "!="))
-        {
-            Node *rhs = relational(&tok, tok->next);
-            node = new_binary(ND_NE, node, rhs);
-            continue;
-        }
-        *rest = tok;
-        return node;
+    switch (c)
+    {
+    case '=':
+        return eq ? &binops[1] : &binops[0];
+    case '!':
+        return eq ? &binops[2] : NULL;
+    case '<':
+        return eq ? &binops[4] : &binops[3];
+    case '>':
+        return eq ? &binops[6] : &binops[5];
+    case '+':
+        return eq ? NULL : &binops[7];
+    case '-':
+        return eq ? NULL : &binops[8];
+    case '*':
+        return eq ? NULL : &binops[9];
+    case '/':
+        return eq ? NULL : &binops[10];
     }
+    return NULL;
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(Token **rest, Token *tok)
+/**
+ * @brief 演算子スタックの先頭の演算子を取り出し、被演算子スタックの値からノードを組み立てる
+ */
+static void reduce(void)
 {
-    Node *node = add(&tok, tok);
+    BinOp *op = ops[--ops_len];
+    int loc = ops_loc[ops_len];
+    if (op == &neg_op)
+    {
+        NodeId node = vals[--vals_len];
+        push_val(new_binary(ND_SUB, new_num(0, loc), node, loc));
+        return;
+    }
+
+    NodeId rhs = vals[--vals_len];
+    NodeId lhs = vals[--vals_len];
+    // 最適化パスとコード生成は代入の左辺が変数であることを前提にする
+    if (op->kind == ND_ASSIGN && nd(lhs)->kind != ND_VAR)
+    {
+        error_loc(loc, "not an lvalue");
+    }
+    if (op->swap)
+    {
+        push_val(new_binary(op->kind, rhs, lhs, loc));
+    }
+    else
+    {
+        push_val(new_binary(op->kind, lhs, rhs, loc));
+    }
+}
+
+/**
+ * @brief 演算子スタックの先頭の演算子が、新しく読んだ二項演算子opより先に還元されるべきか判定する
+ */
+static bool binds_tighter(BinOp *top, BinOp *op)
+{
+    if (top == &paren_op)
+    {
+        return false;
+    }
+    if (top == &neg_op)
+    {
+        return true;
+    }
+    return top->prec > op->prec || (top->prec == op->prec && !op->right);
+}
+
+// expr = unary (binop unary)*
+// unary = ("+" | "-" | "(")* primary ")"*
+//
+// 結合力表に従う演算子順位法で式をパースする。
+// 再帰を用いず明示的なスタックで処理するため、ネストの深さはメモリ量のみで制限される。
+static NodeId expr(int *rest, int tok)
+{
+    int ops_base = ops_len;
+    int vals_base = vals_len;
+    int depth = 0;
 
     for (;;)
     {
-        if (equal(tok, "<"))
+        // 前置演算子と開き括弧
+        for (;;)
         {
-            Node *rhs = add(&tok, tok->next);
-            node = new_binary(ND_LT, node, rhs);
-            continue;
+            if (equal(tok, "+"))
+            {
+                tok = tok + 1;
+                continue;
+            }
+            if (equal(tok, "-"))
+            {
+                push_op(&neg_op, tok_offset(tok));
+                tok = tok + 1;
+                continue;
+            }
+            if (equal(tok, "("))
+            {
+                push_op(&paren_op, tok_offset(tok));
+                depth++;
+                tok = tok + 1;
+                continue;
+            }
+            break;
         }
 
-        if (equal(tok, "<="))
+        push_val(primary(&tok, tok));
+
+        // 閉じ括弧
+        while (depth > 0 && equal(tok, ")"))
         {
-            Node *rhs = add(&tok, tok->next);
-            node = new_binary(ND_LE, node, rhs);
-            continue;
+            while (ops[ops_len - 1] != &paren_op)
+            {
+                reduce();
+            }
+            ops_len--;
+            depth--;
+            tok = tok + 1;
         }
 
-        if (equal(tok, ">"))
+        BinOp *op = find_binop(tok);
+        if (!op)
         {
-            Node *rhs = add(&tok, tok->next);
-            node = new_binary(ND_LT, rhs, node);
-            continue;
+            break;
         }
-
-        if (equal(tok, ">="))
+        while (ops_len > ops_base && binds_tighter(ops[ops_len - 1], op))
         {
-            Node *rhs = add(&tok, tok->next);
-            node = new_binary(ND_LE, rhs, node);
-            continue;
+            reduce();
         }
+        push_op(op, tok_offset(tok));
+        tok = tok + 1;
+    }
 
-        *rest = tok;
-        return node;
+    if (depth > 0)
+    {
+        error_tok(tok, "expected ')'");
+    }
+    while (ops_len > ops_base)
+    {
+        reduce();
     }
+    assert(vals_len == vals_base + 1);
+
+    *rest = tok;
+    return vals[--vals_len];
 }
 
-// add = mul ("+" mul | "-" mul)*
-static Node *add(Token **rest, Token *tok)
+// funcall = ident "(" (expr ("," expr)*)? ")"
+static NodeId funcall(int *rest, int tok)
 {
-    Node *node = mul(&tok, tok);
-
-    for (;;)
+    int loc = tok_offset(tok);
+    NodeId id = new_node(ND_FUNCALL, loc);
+    Function *fn = find_func(tok_loc(tok), tok_len(tok));
+    fn->ncalls++;
+    nd(id)->func = fn;
+
+    int nargs = 0;
+    NodeId *cur = &nd(id)->args;
+    tok = tok + 2;
+    while (!equal(tok, ")"))
     {
-        if (equal(tok, "+"))
+        if (nargs > 0)
         {
-            Node *rhs = mul(&tok, tok->next);
-            node = new_binary(ND_ADD, node, rhs);
-            continue;
+            tok = skip(tok, ",");
         }
-        if (equal(tok, "-"))
+        if (nargs == MAX_PARAMS)
         {
-            Node *rhs = mul(&tok, tok->next);
-            node = new_binary(ND_SUB, node, rhs);
-            continue;
+            error_tok(tok, "too many arguments");
         }
+        *cur = expr(&tok, tok);
+        cur = &nd(*cur)->next;
+        nargs++;
+    }
+    *rest = tok + 1;
 
-        *rest = tok;
-        return node;
+    if (!fn->defined)
+    {
+        if (npending == pending_cap)
+        {
+            pending_cap = pending_cap ? pending_cap * 2 : 16;
+            pending = realloc(pending, sizeof(*pending) * pending_cap);
+        }
+        pending[npending++] = (PendingCall){fn, nargs, loc};
+    }
+    else if (nargs != fn->nparams)
+    {
+        error_loc(loc, "wrong number of arguments");
     }
+    return id;
 }
 
-// mul = unary ("*" unary | "/" unary)*
-static Node *mul(Token **rest, Token *tok)
+// primary = funcall | ident | num
+static NodeId primary(int *rest, int tok)
 {
-    Node *node = unary(&tok, tok);
-
-    for (;;)
+    if (tok_kind(tok) == TK_IDENT && equal(tok + 1, "("))
     {
-        if (equal(tok, "*"))
-        {
-            Node *rhs = unary(&tok, tok->next);
-            node = new_binary(ND_MUL, node, rhs);
-            continue;
-        }
+        return funcall(rest, tok);
+    }
 
-        if (equal(tok, "/"))
+    if (tok_kind(tok) == TK_IDENT)
+    {
+        Var *var = find_var(tok);
+        if (!var)
         {
-            Node *rhs = unary(&tok, tok->next);
-            node = new_binary(ND_DIV, node, rhs);
-            continue;
+            var = new_lvar(strndup(tok_loc(tok), tok_len(tok)));
         }
-
-        *rest = tok;
-        return node;
+        *rest = tok + 1;
+        return new_var_node(var, tok_offset(tok));
     }
+
+    NodeId node = new_num(get_number(tok), tok_offset(tok));
+    *rest = tok + 1;
+    return node;
 }
 
-// unary = ("+" | "-")? unary
-//       | prinary
-static Node *unary(Token **rest, Token *tok)
+/**
+ * @brief 関数定義の始まりか判定する。呼び出しと区別するため、仮引数の並びの後の"{"まで先読みする
+ */
+static bool is_funcdef(int tok)
 {
-    if (equal(tok, "+"))
+    if (tok_kind(tok) != TK_IDENT || !equal(tok + 1, "("))
     {
-        return unary(rest, tok->next);
+        return false;
     }
 
-    if (equal(tok, "-"))
+    tok = tok + 2;
+    for (int i = 0; i < MAX_PARAMS && tok_kind(tok) == TK_IDENT; i++)
     {
-        return new_binary(ND_SUB, new_num(0), unary(rest, tok->next));
+        tok = tok + 1;
+        if (!equal(tok, ","))
+        {
+            break;
+        }
+        tok = tok + 1;
     }
-
-    return primary(rest, tok);
+    return equal(tok, ")") && equal(tok + 1, "{");
 }
 
-// primary = "(" expr ")" | ident | num
-static Node *primary(Token **rest, Token *tok)
+// funcdef = ident "(" (ident ("," ident)*)? ")" "{" stmt* "}"
+static void funcdef(int *rest, int tok)
 {
-    if (equal(tok, "("))
+    Function *fn = find_func(tok_loc(tok), tok_len(tok));
+    if (fn->defined)
     {
-        Node *node = expr(&tok, tok->next);
-        *rest = skip(tok, ")");
-        return node;
+        error_tok(tok, "redefinition of function");
     }
+    fn->defined = true;
 
-    if (tok->kind == TK_IDENT)
+    // 仮引数は番号が0から順のローカル変数にする
+    tok = tok + 2;
+    while (!equal(tok, ")"))
     {
-        Var *var = find_var(tok);
-        if (!var)
+        if (fn->nparams > 0)
         {
-            var = new_lvar(strndup(tok->loc, tok->len));
+            tok = skip(tok, ",");
         }
-        *rest = tok->next;
-        return new_var_node(var);
+        if (find_var(tok))
+        {
+            error_tok(tok, "duplicate parameter");
+        }
+        new_lvar(strndup(tok_loc(tok), tok_len(tok)));
+        fn->nparams++;
+        tok = tok + 1;
+    }
+    if (fn->nparams > 0 && !strcmp(fn->name, "main"))
+    {
+        error_tok(tok, "main cannot take parameters");
     }
 
-    Node *node = new_num(get_number(tok));
-    *rest = tok->next;
-    return node;
+    NodeId *cur = &fn->node;
+    tok = skip(tok + 1, "{");
+    while (!equal(tok, "}"))
+    {
+        *cur = stmt(&tok, tok);
+        cur = &nd(*cur)->next;
+    }
+    *rest = tok + 1;
+    fn->locals = locals;
 }
 
-// program = stmt*
-Function *parse(Token *tok)
+// program = (funcdef | stmt)*
+Function *parse(TokenBuf *buf)
 {
-    Node head = {};
-    Node *cur = &head;
+    set_token_buf(buf);
+    int tok = 0;
+
+    // 関数定義の外の文は暗黙のmain関数の本体に並べる
+    Function *main_fn = NULL;
+    Var *main_locals = NULL;
+    NodeId *cur = NULL;
+
+    while (tok_kind(tok) != TK_EOF)
+    {
+        if (is_funcdef(tok))
+        {
+            Var *saved = locals;
+            locals = NULL;
+            funcdef(&tok, tok);
+            locals = saved;
+            continue;
+        }
+
+        if (!main_fn)
+        {
+            main_fn = find_func("main", 4);
+            if (main_fn->defined)
+            {
+                error_tok(tok, "statement outside of main");
+            }
+            main_fn->defined = true;
+            cur = &main_fn->node;
+        }
+        *cur = stmt(&tok, tok);
+        cur = &nd(*cur)->next;
+        main_locals = locals;
+    }
 
-    while (tok->kind != TK_EOF)
+    // 文がなく、mainも定義されていない場合は空のmainとする
+    if (!main_fn)
     {
-        cur = cur->next = stmt(&tok, tok);
+        main_fn = find_func("main", 4);
+        main_fn->defined = true;
+    }
+    if (!main_fn->locals)
+    {
+        main_fn->locals = main_locals;
     }
 
-    Function *prog = calloc(1, sizeof(Function));
-    prog->node = head.next;
-    prog->locals = locals;
-    return prog;
+    for (int i = 0; i < npending; i++)
+    {
+        PendingCall *c = &pending[i];
+        if (!c->func->defined)
+        {
+            error_loc(c->loc, "undefined function");
+        }
+        if (c->nargs != c->func->nparams)
+        {
+            error_loc(c->loc, "wrong number of arguments");
+        }
+    }
+    return functions;
 }
\ No newline at end of file
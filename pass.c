@@ -0,0 +1,380 @@
+#include "orecc.h"
+#include <time.h>
+
+/**
+ * @brief nをalignの倍数に切り上げる
+ *
+ * @param n 値
+ * @param align 2のべき乗の境界
+ * @return 切り上げた値
+ */
+static int align_to(int n, int align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+/**
+ * @brief ローカル変数にスタック上の領域を割り当てる。callee-savedレジスタの退避領域はcodegenが変数の下に置く
+ *
+ * @return 領域を割り当てた変数の数
+ */
+static int frame(Function *prog)
+{
+    int n = 0;
+    int offset = 0;
+    for (Var *var = prog->locals; var; var = var->next)
+    {
+        offset += 8;
+        var->offset = offset;
+        n++;
+    }
+    prog->stack_size = align_to(offset, 16);
+    return n;
+}
+
+/**
+ * @brief 最適化パス
+ */
+typedef struct
+{
+    /**
+     * @brief -fpass=, -fno-pass=, --print-after= で指定する名前
+     */
+    char *name;
+
+    /**
+     * @brief パスを実行し、変更したノードの数を返す
+     */
+    int (*run)(Function *prog);
+
+    /**
+     * @brief 既定で有効になる最適化レベルの下限
+     */
+    int level;
+
+    /**
+     * @brief コード生成に必須で無効にできない場合true
+     */
+    bool required;
+
+    /**
+     * @brief -fpass=, -fno-pass= による指定。未指定の場合は-1
+     */
+    int enabled;
+} Pass;
+
+// 実行順に並べたパスの一覧
+static Pass passes[] = {
+    {"inline", inliner, 1, false, -1},
+    {"scev", scev, 1, false, -1},
+    {"unroll", unroll, 2, false, -1},
+    {"reassoc", reassoc, 2, false, -1},
+    {"vrp", vrp, 1, false, -1},
+    {"cse", cse, 1, false, -1},
+    {"ifcvt", ifcvt, 1, false, -1},
+    {"dse", dse, 1, false, -1},
+    {"frame", frame, 0, true, -1},
+};
+
+#define NPASSES ((int)(sizeof(passes) / sizeof(*passes)))
+
+static Pass *find_pass(char *name)
+{
+    for (int i = 0; i < NPASSES; i++)
+    {
+        if (!strcmp(passes[i].name, name))
+        {
+            return &passes[i];
+        }
+    }
+    error("unknown pass: %s", name);
+    return NULL;
+}
+
+void set_pass(char *name, bool enable)
+{
+    Pass *pass = find_pass(name);
+    if (pass->required && !enable)
+    {
+        error("pass %s cannot be disabled", name);
+    }
+    pass->enabled = enable;
+}
+
+static bool is_enabled(Pass *pass)
+{
+    if (pass->required)
+    {
+        return true;
+    }
+    if (pass->enabled >= 0)
+    {
+        return pass->enabled;
+    }
+    return pass->level <= opt_level;
+}
+
+static void print_top(FILE *out, NodeId id);
+
+static void print_expr(FILE *out, NodeId id)
+{
+    Node *node = nd(id);
+    char *op;
+    switch (node->kind)
+    {
+    case ND_NUM:
+        fprintf(out, "%ld", node->val);
+        return;
+    case ND_VAR:
+        fprintf(out, "%s", node->var->name);
+        return;
+    case ND_ASSIGN:
+        fprintf(out, "(");
+        print_expr(out, node->lhs);
+        fprintf(out, " = ");
+        print_expr(out, node->rhs);
+        fprintf(out, ")");
+        return;
+    case ND_FUNCALL:
+        fprintf(out, "%s(", node->func->name);
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            print_top(out, arg);
+            if (nd(arg)->next)
+            {
+                fprintf(out, ", ");
+            }
+        }
+        fprintf(out, ")");
+        return;
+    case ND_SELECT:
+        fprintf(out, "(");
+        print_expr(out, node->cond);
+        fprintf(out, " ? ");
+        print_expr(out, node->then);
+        fprintf(out, " : ");
+        print_expr(out, node->els);
+        fprintf(out, ")");
+        return;
+    case ND_ADD:
+        op = "+";
+        break;
+    case ND_SUB:
+        op = "-";
+        break;
+    case ND_MUL:
+        op = "*";
+        break;
+    case ND_DIV:
+        op = "/";
+        break;
+    case ND_UDIV:
+        op = "/u";
+        break;
+    case ND_SHR:
+        op = ">>";
+        break;
+    case ND_EQ:
+        op = "==";
+        break;
+    case ND_NE:
+        op = "!=";
+        break;
+    case ND_LT:
+        op = "<";
+        break;
+    case ND_LE:
+        op = "<=";
+        break;
+    default:
+        fprintf(out, "<%d>", node->kind);
+        return;
+    }
+
+    // 優先順位を考えずに済むよう、二項演算は常に括弧で囲む
+    fprintf(out, "(");
+    print_expr(out, node->lhs);
+    fprintf(out, " %s ", op);
+    print_expr(out, node->rhs);
+    fprintf(out, ")");
+}
+
+/**
+ * @brief 文の最も外側の式を出力する。代入は括弧で囲まない
+ */
+static void print_top(FILE *out, NodeId id)
+{
+    Node *node = nd(id);
+    if (node->kind != ND_ASSIGN)
+    {
+        print_expr(out, id);
+        return;
+    }
+    print_expr(out, node->lhs);
+    fprintf(out, " = ");
+    print_expr(out, node->rhs);
+}
+
+static void print_stmt(FILE *out, NodeId id, int depth)
+{
+    Node *node = nd(id);
+    fprintf(out, "%*s", depth * 4, "");
+
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        fprintf(out, "return ");
+        print_top(out, node->lhs);
+        fprintf(out, ";\n");
+        return;
+    case ND_EXPR_STMT:
+        print_top(out, node->lhs);
+        fprintf(out, ";\n");
+        return;
+    case ND_IF:
+        fprintf(out, "if (");
+        print_expr(out, node->cond);
+        fprintf(out, ")\n");
+        print_stmt(out, node->then, depth + 1);
+        if (node->els)
+        {
+            fprintf(out, "%*selse\n", depth * 4, "");
+            print_stmt(out, node->els, depth + 1);
+        }
+        return;
+    case ND_FOR:
+        fprintf(out, "for (");
+        if (node->init)
+        {
+            print_top(out, nd(node->init)->lhs);
+        }
+        fprintf(out, "; ");
+        if (node->cond)
+        {
+            print_expr(out, node->cond);
+        }
+        fprintf(out, "; ");
+        if (node->inc)
+        {
+            print_top(out, nd(node->inc)->lhs);
+        }
+        fprintf(out, ")\n");
+        print_stmt(out, node->then, depth + 1);
+        return;
+    case ND_BLOCK:
+        fprintf(out, "{\n");
+        for (NodeId n = node->body; n; n = nd(n)->next)
+        {
+            print_stmt(out, n, depth + 1);
+        }
+        fprintf(out, "%*s}\n", depth * 4, "");
+        return;
+    default:
+        fprintf(out, "<%d>\n", node->kind);
+        return;
+    }
+}
+
+/**
+ * @brief 関数を入力と同じ形で出力する。mainの本体は関数定義の外の文として出力する
+ */
+static void print_prog(FILE *out, Function *prog)
+{
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        if (!is_live(fn) || !strcmp(fn->name, "main"))
+        {
+            continue;
+        }
+
+        fprintf(out, "%s(", fn->name);
+        for (int i = 0; i < fn->nparams; i++)
+        {
+            for (Var *var = fn->locals; var; var = var->next)
+            {
+                if (var->id == i)
+                {
+                    fprintf(out, i ? ", %s" : "%s", var->name);
+                }
+            }
+        }
+        fprintf(out, ") {\n");
+        for (NodeId n = fn->node; n; n = nd(n)->next)
+        {
+            print_stmt(out, n, 1);
+        }
+        fprintf(out, "}\n");
+    }
+
+    for (Function *fn = prog; fn; fn = fn->next)
+    {
+        if (!strcmp(fn->name, "main"))
+        {
+            for (NodeId n = fn->node; n; n = nd(n)->next)
+            {
+                print_stmt(out, n, 0);
+            }
+        }
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run_passes(Function *prog)
+{
+    if (opt_print_after)
+    {
+        find_pass(opt_print_after);
+    }
+
+    if (opt_pass_stats)
+    {
+        fprintf(stderr, "%-12s %10s %8s %8s\n", "pass", "time(us)", "changed", "nodes");
+    }
+
+    double total = 0;
+    for (int i = 0; i < NPASSES; i++)
+    {
+        Pass *pass = &passes[i];
+        if (!is_enabled(pass))
+        {
+            continue;
+        }
+
+        // 各関数に順に実行する。インライン展開で呼び出されなくなった関数は飛ばす
+        int nodes = node_count();
+        double start = now();
+        int changed = 0;
+        for (Function *fn = prog; fn; fn = fn->next)
+        {
+            if (is_live(fn))
+            {
+                changed += pass->run(fn);
+            }
+        }
+        double elapsed = now() - start;
+        total += elapsed;
+
+        // ノード数は新たに割り当てたノードの数を表す
+        if (opt_pass_stats)
+        {
+            fprintf(stderr, "%-12s %10.1f %8d %+8d\n", pass->name, elapsed * 1e6, changed, node_count() - nodes);
+        }
+
+        if (opt_print_after && !strcmp(opt_print_after, pass->name))
+        {
+            fprintf(stderr, "*** after %s ***\n", pass->name);
+            print_prog(stderr, prog);
+        }
+    }
+
+    if (opt_pass_stats)
+    {
+        fprintf(stderr, "%-12s %10.1f\n", "total", total * 1e6);
+    }
+}
@@ -0,0 +1,207 @@
+#include "orecc.h"
+
+// 計測結果ファイルの先頭に置く識別子
+#define PROF_MAGIC "ORECCPRF"
+
+// 各カウンタに対応するソースコード上の位置
+static int *counter_locs;
+static int ncounters;
+static int counters_cap;
+
+int prof_counter(int loc)
+{
+    if (!opt_profile)
+    {
+        return -1;
+    }
+
+    if (ncounters == counters_cap)
+    {
+        counters_cap = counters_cap ? counters_cap * 2 : 64;
+        counter_locs = realloc(counter_locs, sizeof(*counter_locs) * counters_cap);
+    }
+    counter_locs[ncounters] = loc;
+    return ncounters++;
+}
+
+void prof_inc(int idx)
+{
+    if (idx < 0)
+    {
+        return;
+    }
+
+    // フラグレジスタは基本ブロックの先頭では生存していないためincで更新してよい
+    printf("    inc qword ptr [rip+.L.prof.counters+%d]\n", idx * 8);
+}
+
+void prof_count(int loc)
+{
+    prof_inc(prof_counter(loc));
+}
+
+void prof_emit_dump(void)
+{
+    if (!opt_profile)
+    {
+        return;
+    }
+
+    // open/write/closeのシステムコールで計測結果を書き出す
+    // syscallはrcx, r11, raxのみを破壊するため、戻り値のraxだけを退避する
+    printf("  push rax\n");
+    printf("  mov eax, 2\n");
+    printf("  lea rdi, [rip+.L.prof.path]\n");
+    printf("  mov esi, 0x241\n"); // O_WRONLY | O_CREAT | O_TRUNC
+    printf("  mov edx, 420\n");  // 0644
+    printf("  syscall\n");
+    printf("  test rax, rax\n");
+    printf("  js .L.prof.done\n");
+    printf("  mov rdi, rax\n");
+    printf("  mov eax, 1\n");
+    printf("  lea rsi, [rip+.L.prof.table]\n");
+    printf("  mov edx, %d\n", 16 + ncounters * 8);
+    printf("  syscall\n");
+    printf("  mov eax, 1\n");
+    printf("  lea rsi, [rip+.L.prof.counters]\n");
+    printf("  mov edx, %d\n", ncounters * 8);
+    printf("  syscall\n");
+    printf("  mov eax, 3\n");
+    printf("  syscall\n");
+    printf(".L.prof.done:\n");
+    printf("  pop rax\n");
+}
+
+void prof_emit_data(void)
+{
+    if (!opt_profile)
+    {
+        return;
+    }
+
+    // カウンタ本体
+    printf("  .bss\n");
+    printf("  .align 8\n");
+    printf(".L.prof.counters:\n");
+    printf("  .zero %d\n", ncounters ? ncounters * 8 : 8);
+
+    // 識別子、カウンタ数、各カウンタのソースコード上の位置
+    printf("  .section .rodata\n");
+    printf("  .align 8\n");
+    printf(".L.prof.table:\n");
+    printf("  .ascii \"%s\"\n", PROF_MAGIC);
+    printf("  .quad %d\n", ncounters);
+    for (int i = 0; i < ncounters; i++)
+    {
+        printf("  .quad %d\n", counter_locs[i]);
+    }
+
+    printf(".L.prof.path:\n");
+    printf("  .byte ");
+    for (char *p = opt_profile; *p; p++)
+    {
+        printf("%d,", (unsigned char)*p);
+    }
+    printf("0\n");
+}
+
+typedef struct
+{
+    long loc;
+    long count;
+} Counter;
+
+static int compare_counters(const void *a, const void *b)
+{
+    long x = ((Counter *)a)->loc;
+    long y = ((Counter *)b)->loc;
+    return (x > y) - (x < y);
+}
+
+void annotate(char *input, char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        error("cannot open %s", path);
+    }
+
+    char magic[8];
+    long n;
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, PROF_MAGIC, 8) || fread(&n, sizeof(n), 1, fp) != 1 || n < 0)
+    {
+        error("%s: not an orecc profile", path);
+    }
+
+    long *locs = calloc(n + 1, sizeof(long));
+    long *counts = calloc(n + 1, sizeof(long));
+    if (fread(locs, sizeof(long), n, fp) != n || fread(counts, sizeof(long), n, fp) != n)
+    {
+        error("%s: truncated profile", path);
+    }
+    fclose(fp);
+
+    long len = strlen(input);
+    Counter *c = calloc(n + 1, sizeof(Counter));
+    for (long i = 0; i < n; i++)
+    {
+        if (locs[i] < 0 || len < locs[i])
+        {
+            error("%s: profile does not match the input", path);
+        }
+        c[i].loc = locs[i];
+        c[i].count = counts[i];
+    }
+    qsort(c, n, sizeof(Counter), compare_counters);
+
+    // 行ごとに、行内のカウンタの最大値を左端に、各カウンタの値を位置の直前に表示する
+    long ci = 0;
+    char *line = input;
+    for (;;)
+    {
+        char *end = strchr(line, '\n');
+        if (!end)
+        {
+            end = input + len;
+        }
+
+        long max = -1;
+        for (long i = ci; i < n && c[i].loc <= end - input; i++)
+        {
+            max = c[i].count > max ? c[i].count : max;
+        }
+        if (max < 0)
+        {
+            printf("%10s | ", "");
+        }
+        else
+        {
+            printf("%10ld | ", max);
+        }
+
+        for (char *p = line;; p++)
+        {
+            if (ci < n && c[ci].loc == p - input)
+            {
+                printf("/*%ld", c[ci++].count);
+                while (ci < n && c[ci].loc == p - input)
+                {
+                    printf(",%ld", c[ci++].count);
+                }
+                printf("*/");
+            }
+            if (p == end)
+            {
+                break;
+            }
+            putchar(*p);
+        }
+        putchar('\n');
+
+        if (!*end || !end[1])
+        {
+            break;
+        }
+        line = end + 1;
+    }
+}
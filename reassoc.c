@@ -0,0 +1,380 @@
+#include "orecc.h"
+
+// 長い連鎖を分ける部分和(部分積)の数の上限
+#define MAX_WIDTH 4
+
+// 式の評価に使えるレジスタの数。codegenのレジスタスタックの大きさ
+#define NREGS 6
+
+/**
+ * @brief 連鎖の項の並び
+ */
+typedef struct
+{
+    NodeId *ids;
+    int len;
+    int cap;
+} Terms;
+
+static void push(Terms *t, NodeId id)
+{
+    if (t->len == t->cap)
+    {
+        t->cap = t->cap ? t->cap * 2 : 8;
+        t->ids = realloc(t->ids, sizeof(*t->ids) * t->cap);
+    }
+    t->ids[t->len++] = id;
+}
+
+/**
+ * @brief 即値またはメモリ参照としてレジスタを使わずに命令のオペランドにできるか判定する
+ */
+static bool is_operand(NodeId id)
+{
+    Node *node = nd(id);
+    return node->kind == ND_VAR || (node->kind == ND_NUM && INT_MIN <= node->val && node->val <= INT_MAX);
+}
+
+/**
+ * @brief 式の評価に必要なレジスタ数を見積もる。codegenと同じく、左辺を評価した後、右辺の評価中は
+ * 左辺の値を保持する。ただし即値とメモリ参照はオペランドに直接書き、可換な演算では定数の左辺を右辺と入れ替える
+ */
+static int reg_need(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return 1;
+    case ND_ASSIGN:
+        return reg_need(node->rhs);
+    case ND_FUNCALL:
+    {
+        // 引数は1つずつ評価してスタックに積む
+        int need = 1;
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            int n = reg_need(arg);
+            need = n > need ? n : need;
+        }
+        return need;
+    }
+    default:
+        break;
+    }
+
+    int l = reg_need(node->lhs);
+    if (is_operand(node->rhs))
+    {
+        return l;
+    }
+    int r = reg_need(node->rhs);
+    // 変数の左辺は、後のパスで右辺に代入が入ると入れ替えられなくなるため数えない
+    bool commutative = node->kind != ND_SUB && node->kind != ND_DIV && node->kind != ND_UDIV && node->kind != ND_SHR;
+    if (commutative && is_operand(node->lhs) && nd(node->lhs)->kind == ND_NUM)
+    {
+        return r;
+    }
+    return l > r + 1 ? l : r + 1;
+}
+
+// 長い連鎖を分ける部分和(部分積)の数
+static int width;
+
+static void reassoc_expr(NodeId id);
+
+/**
+ * @brief 加減算の連鎖の項を集める。定数は加算してcに集める
+ */
+static void collect_sum(NodeId id, bool neg, Terms *pos, Terms *negs, unsigned long *c, int *nconsts)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_ADD:
+    case ND_SUB:
+        collect_sum(node->lhs, neg, pos, negs, c, nconsts);
+        collect_sum(node->rhs, node->kind == ND_SUB ? !neg : neg, pos, negs, c, nconsts);
+        return;
+    case ND_NUM:
+        *c += neg ? -(unsigned long)node->val : (unsigned long)node->val;
+        (*nconsts)++;
+        return;
+    default:
+        push(neg ? negs : pos, id);
+        return;
+    }
+}
+
+/**
+ * @brief 乗算の連鎖の因数を集める。定数は乗算してcに集める
+ */
+static void collect_prod(NodeId id, Terms *factors, unsigned long *c, int *nconsts)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_MUL:
+        collect_prod(node->lhs, factors, c, nconsts);
+        collect_prod(node->rhs, factors, c, nconsts);
+        return;
+    case ND_NUM:
+        *c *= node->val;
+        (*nconsts)++;
+        return;
+    default:
+        push(factors, id);
+        return;
+    }
+}
+
+/**
+ * @brief 項をwidth個の部分和に振り分け、各部分和を左から順に計算してから部分和どうしを2つずつ合わせる。
+ * 部分和の計算は互いに依存しないため、並列に実行できる
+ */
+static NodeId build(Terms *t, NodeKind kind, int loc)
+{
+    int w = width < t->len ? width : t->len;
+    NodeId acc[MAX_WIDTH];
+    for (int j = 0; j < w; j++)
+    {
+        acc[j] = t->ids[j];
+        for (int i = j + w; i < t->len; i += w)
+        {
+            acc[j] = new_binary(kind, acc[j], t->ids[i], loc);
+        }
+    }
+
+    for (int n = w; n > 1; n = (n + 1) / 2)
+    {
+        for (int j = 0; j < n / 2; j++)
+        {
+            acc[j] = new_binary(kind, acc[2 * j], acc[2 * j + 1], loc);
+        }
+        if (n % 2)
+        {
+            acc[n / 2] = acc[n - 1];
+        }
+    }
+    return acc[0];
+}
+
+/**
+ * @brief 加減算の連鎖を組み直す。正の項の和から負の項の和を引き、最後に定数を加える
+ */
+static NodeId build_sum(Terms *pos, Terms *negs, unsigned long c, int loc)
+{
+    NodeId node;
+    if (pos->len)
+    {
+        node = build(pos, ND_ADD, loc);
+        if (negs->len)
+        {
+            node = new_binary(ND_SUB, node, build(negs, ND_ADD, loc), loc);
+        }
+    }
+    else if (negs->len)
+    {
+        node = new_binary(ND_SUB, new_num(c, loc), build(negs, ND_ADD, loc), loc);
+        c = 0;
+    }
+    else
+    {
+        return new_num(c, loc);
+    }
+
+    if (c)
+    {
+        node = new_binary(ND_ADD, node, new_num(c, loc), loc);
+    }
+    return node;
+}
+
+static NodeId build_prod(Terms *factors, unsigned long c, int loc)
+{
+    if (!factors->len)
+    {
+        return new_num(c, loc);
+    }
+
+    NodeId node = build(factors, ND_MUL, loc);
+    if (c != 1)
+    {
+        node = new_binary(ND_MUL, node, new_num(c, loc), loc);
+    }
+    return node;
+}
+
+static int changed;
+
+/**
+ * @brief 副作用のない加減算または乗算の連鎖を平坦にし、定数をまとめて木を組み直す
+ *
+ * @param id 連鎖の根のノード
+ */
+static void reassoc_chain(NodeId id)
+{
+    Node *node = nd(id);
+    Terms pos = {}, negs = {};
+    unsigned long c;
+    int nconsts;
+
+    // 項の中の式も組み直す。項が定数に畳み込まれることがあるため、組み直した後に項を集め直す
+    for (int pass = 0; pass < 2; pass++)
+    {
+        pos.len = negs.len = 0;
+        c = node->kind == ND_MUL;
+        nconsts = 0;
+        if (node->kind == ND_MUL)
+        {
+            collect_prod(id, &pos, &c, &nconsts);
+        }
+        else
+        {
+            collect_sum(id, false, &pos, &negs, &c, &nconsts);
+        }
+        if (pass)
+        {
+            break;
+        }
+
+        for (int i = 0; i < pos.len; i++)
+        {
+            reassoc_expr(pos.ids[i]);
+        }
+        for (int i = 0; i < negs.len; i++)
+        {
+            reassoc_expr(negs.ids[i]);
+        }
+    }
+
+    // 2項だけの連鎖は、定数をまとめられる場合を除いて組み直さない
+    int nterms = pos.len + negs.len;
+    bool identity = node->kind == ND_MUL ? c == 1 : c == 0;
+    if (nterms + nconsts >= 3 || nconsts >= 2 || (nconsts == 1 && identity && pos.len))
+    {
+        NodeId root = node->kind == ND_MUL ? build_prod(&pos, c, node->loc) : build_sum(&pos, &negs, c, node->loc);
+        replace_node(id, root);
+        changed++;
+    }
+
+    free(pos.ids);
+    free(negs.ids);
+}
+
+static void reassoc_expr(NodeId id)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return;
+    case ND_ASSIGN:
+        reassoc_expr(node->rhs);
+        return;
+    case ND_FUNCALL:
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            reassoc_expr(arg);
+        }
+        return;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+        if (is_pure(id))
+        {
+            reassoc_chain(id);
+            return;
+        }
+        break;
+    case ND_DIV:
+    {
+        reassoc_expr(node->lhs);
+        reassoc_expr(node->rhs);
+
+        // 定数どうしの除算は畳み込む。0除算と桁あふれは実行時に任せる
+        Node *l = nd(node->lhs);
+        Node *r = nd(node->rhs);
+        if (l->kind == ND_NUM && r->kind == ND_NUM && r->val != 0 && !(l->val == LONG_MIN && r->val == -1))
+        {
+            node->kind = ND_NUM;
+            node->val = l->val / r->val;
+            changed++;
+        }
+        return;
+    }
+    default:
+        break;
+    }
+
+    reassoc_expr(node->lhs);
+    reassoc_expr(node->rhs);
+}
+
+/**
+ * @brief 文の式を組み直す。組み直した式の評価にレジスタが足りない場合は部分和の数を減らして
+ * やり直し、それでも足りない場合は元の式に戻す
+ */
+static void reassoc_top(NodeId id)
+{
+    int saved = changed;
+    NodeId orig = copy_tree(id);
+    for (width = MAX_WIDTH; width >= 1; width /= 2)
+    {
+        reassoc_expr(id);
+        if (reg_need(id) <= NREGS)
+        {
+            return;
+        }
+        replace_node(id, copy_tree(orig));
+        changed = saved;
+    }
+}
+
+static void walk(NodeId id)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        reassoc_top(node->lhs);
+        return;
+    case ND_IF:
+    case ND_FOR:
+        walk(node->init);
+        if (node->cond)
+        {
+            reassoc_top(node->cond);
+        }
+        walk(node->then);
+        walk(node->els);
+        walk(node->inc);
+        return;
+    case ND_BLOCK:
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            walk(s);
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+int reassoc(Function *prog)
+{
+    changed = 0;
+    for (NodeId s = prog->node; s; s = nd(s)->next)
+    {
+        walk(s);
+    }
+    return changed;
+}
@@ -0,0 +1,459 @@
+#include "orecc.h"
+
+// ループ本体で扱う帰納変数の多項式の最大次数
+#define MAX_DEGREE 3
+
+/**
+ * @brief 繰り返し回数kの多項式。係数は2の64乗を法とする
+ */
+typedef struct
+{
+    unsigned long c[MAX_DEGREE + 1];
+} Poly;
+
+static bool is_var(NodeId id, Var *var)
+{
+    return nd(id)->kind == ND_VAR && nd(id)->var == var;
+}
+
+/**
+ * @brief 定数の加減乗算のみからなる式の値を求める。-1のような負の定数もこの形になる
+ *
+ * @param id 式のノード
+ * @param val 値の格納先
+ * @return 定数式の場合true
+ */
+static bool const_value(NodeId id, long *val)
+{
+    Node *node = nd(id);
+    long l, r;
+    switch (node->kind)
+    {
+    case ND_NUM:
+        *val = node->val;
+        return true;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+        if (!const_value(node->lhs, &l) || !const_value(node->rhs, &r))
+        {
+            return false;
+        }
+        if (node->kind == ND_ADD)
+        {
+            *val = (unsigned long)l + r;
+        }
+        else if (node->kind == ND_SUB)
+        {
+            *val = (unsigned long)l - r;
+        }
+        else
+        {
+            *val = (unsigned long)l * r;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool counted_loop(Node *node, CountedLoop *loop)
+{
+    if (node->kind != ND_FOR || !node->init || !node->cond || !node->inc)
+    {
+        return false;
+    }
+
+    // 初期化式: iv = start
+    Node *init = nd(nd(node->init)->lhs);
+    long c;
+    if (init->kind != ND_ASSIGN || nd(init->lhs)->kind != ND_VAR || !const_value(init->rhs, &c))
+    {
+        return false;
+    }
+    Var *iv = nd(init->lhs)->var;
+    __int128 start = c;
+
+    // 更新式: iv = iv + step | iv = step + iv | iv = iv - step
+    Node *inc = nd(nd(node->inc)->lhs);
+    if (inc->kind != ND_ASSIGN || !is_var(inc->lhs, iv))
+    {
+        return false;
+    }
+    Node *e = nd(inc->rhs);
+    __int128 step;
+    if (e->kind == ND_ADD && is_var(e->lhs, iv) && const_value(e->rhs, &c))
+    {
+        step = c;
+    }
+    else if (e->kind == ND_ADD && const_value(e->lhs, &c) && is_var(e->rhs, iv))
+    {
+        step = c;
+    }
+    else if (e->kind == ND_SUB && is_var(e->lhs, iv) && const_value(e->rhs, &c))
+    {
+        step = -(__int128)c;
+    }
+    else
+    {
+        return false;
+    }
+    if (step == 0 || step > LONG_MAX)
+    {
+        return false;
+    }
+
+    // 条件式: iv < bound | iv <= bound (増加) または bound < iv | bound <= iv (減少)
+    Node *cond = nd(node->cond);
+    if (cond->kind != ND_LT && cond->kind != ND_LE)
+    {
+        return false;
+    }
+    __int128 trip;
+    if (step > 0 && is_var(cond->lhs, iv) && const_value(cond->rhs, &c))
+    {
+        // ivがlast以下の間繰り返す
+        __int128 last = (__int128)c - (cond->kind == ND_LT);
+        trip = start > last ? 0 : (last - start) / step + 1;
+    }
+    else if (step < 0 && const_value(cond->lhs, &c) && is_var(cond->rhs, iv))
+    {
+        // ivがfirst以上の間繰り返す
+        __int128 first = (__int128)c + (cond->kind == ND_LT);
+        trip = start < first ? 0 : (start - first) / -step + 1;
+    }
+    else
+    {
+        return false;
+    }
+
+    // 帰納変数が桁あふれする場合は繰り返し回数が変わるため扱わない
+    __int128 final = start + trip * step;
+    if (final < LONG_MIN || LONG_MAX < final)
+    {
+        return false;
+    }
+
+    if (is_assigned(node->then, iv))
+    {
+        return false;
+    }
+
+    loop->iv = iv;
+    loop->start = start;
+    loop->step = step;
+    loop->trip = trip;
+    loop->final = final;
+    return true;
+}
+
+/**
+ * @brief 帰納変数、累積変数accと定数の加減乗算のみからなる式を、繰り返し回数kの多項式と
+ * accの係数に変換する。accを含む積は扱わない
+ *
+ * @param id 式のノード
+ * @param loop ループの情報
+ * @param acc 累積変数
+ * @param p 変換結果の多項式の格納先
+ * @param coef 変換結果のaccの係数の格納先
+ * @return 変換できた場合true
+ */
+static bool to_poly(NodeId id, CountedLoop *loop, Var *acc, Poly *p, unsigned long *coef)
+{
+    Node *node = nd(id);
+    *p = (Poly){};
+    *coef = 0;
+
+    switch (node->kind)
+    {
+    case ND_NUM:
+        p->c[0] = node->val;
+        return true;
+    case ND_VAR:
+        if (node->var == acc)
+        {
+            *coef = 1;
+            return true;
+        }
+
+        // iv = start + step * k
+        if (node->var != loop->iv)
+        {
+            return false;
+        }
+        p->c[0] = loop->start;
+        p->c[1] = loop->step;
+        return true;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    {
+        Poly l, r;
+        unsigned long lc, rc;
+        if (!to_poly(node->lhs, loop, acc, &l, &lc) || !to_poly(node->rhs, loop, acc, &r, &rc))
+        {
+            return false;
+        }
+
+        if (node->kind == ND_ADD || node->kind == ND_SUB)
+        {
+            for (int i = 0; i <= MAX_DEGREE; i++)
+            {
+                p->c[i] = node->kind == ND_ADD ? l.c[i] + r.c[i] : l.c[i] - r.c[i];
+            }
+            *coef = node->kind == ND_ADD ? lc + rc : lc - rc;
+            return true;
+        }
+
+        if (lc || rc)
+        {
+            return false;
+        }
+        for (int i = 0; i <= MAX_DEGREE; i++)
+        {
+            for (int j = 0; j <= MAX_DEGREE; j++)
+            {
+                if (!l.c[i] || !r.c[j])
+                {
+                    continue;
+                }
+                if (i + j > MAX_DEGREE)
+                {
+                    return false;
+                }
+                p->c[i + j] += l.c[i] * r.c[j];
+            }
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief k = 0, 1, ..., n - 1 についてkのj乗の総和を2の64乗を法として求める
+ */
+static unsigned long power_sum(unsigned long n, int j)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    // 各因数を正確に求めてから割り切れる因数を割り、その後で法の下で掛け合わせる
+    unsigned __int128 a = n - 1, b = n, c = 2 * (unsigned __int128)n - 1;
+    switch (j)
+    {
+    case 0:
+        return n;
+    case 1:
+    case 3:
+    {
+        // n (n - 1) / 2
+        if (a % 2 == 0)
+        {
+            a /= 2;
+        }
+        else
+        {
+            b /= 2;
+        }
+        unsigned long s = (unsigned long)a * (unsigned long)b;
+        return j == 1 ? s : s * s;
+    }
+    case 2:
+        // (n - 1) n (2n - 1) / 6
+        if (a % 2 == 0)
+        {
+            a /= 2;
+        }
+        else
+        {
+            b /= 2;
+        }
+        if (a % 3 == 0)
+        {
+            a /= 3;
+        }
+        else if (b % 3 == 0)
+        {
+            b /= 3;
+        }
+        else
+        {
+            c /= 3;
+        }
+        return (unsigned long)a * (unsigned long)b * (unsigned long)c;
+    }
+    return 0;
+}
+
+/**
+ * @brief ループ本体の文を配列に集める。入れ子の文の並びは平坦にする
+ */
+static void collect_stmts(NodeId id, NodeId **stmts, int *len, int *cap)
+{
+    if (nd(id)->kind == ND_BLOCK)
+    {
+        for (NodeId n = nd(id)->body; n; n = nd(n)->next)
+        {
+            collect_stmts(n, stmts, len, cap);
+        }
+        return;
+    }
+
+    if (*len == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 8;
+        *stmts = realloc(*stmts, sizeof(**stmts) * *cap);
+    }
+    (*stmts)[(*len)++] = id;
+}
+
+/**
+ * @brief ループ本体の各文が、変数への定数の代入か、帰納変数の多項式の足し込みであれば、
+ * ループを終了時の値を求める代入の並びに置き換える
+ *
+ * @param id forループのノード
+ * @return 置き換えた場合true
+ */
+static bool collapse(NodeId id)
+{
+    Node *node = nd(id);
+    CountedLoop loop;
+    if (!counted_loop(node, &loop))
+    {
+        return false;
+    }
+
+    NodeId *stmts = NULL;
+    int len = 0, cap = 0;
+    collect_stmts(node->then, &stmts, &len, &cap);
+
+    Var **vars = calloc(len + 1, sizeof(Var *));
+    NodeId *vals = calloc(len + 1, sizeof(NodeId));
+    bool ok = true;
+
+    for (int i = 0; i < len && ok; i++)
+    {
+        Node *s = nd(stmts[i]);
+        Node *e = s->kind == ND_EXPR_STMT ? nd(s->lhs) : NULL;
+        if (!e || e->kind != ND_ASSIGN || nd(e->lhs)->kind != ND_VAR)
+        {
+            ok = false;
+            break;
+        }
+
+        // 各変数への代入は1回だけ
+        Var *var = nd(e->lhs)->var;
+        for (int j = 0; j < i; j++)
+        {
+            ok = ok && vars[j] != var;
+        }
+        if (!ok || var == loop.iv)
+        {
+            ok = false;
+            break;
+        }
+        vars[i] = var;
+
+        // v = 定数: 終了時の値はその定数
+        long val;
+        if (const_value(e->rhs, &val))
+        {
+            if (loop.trip)
+            {
+                vals[i] = new_binary(ND_ASSIGN, new_var_node(var, node->loc), new_num(val, node->loc), node->loc);
+            }
+            continue;
+        }
+
+        // v = v + P(k): 終了時の値は v + ΣP(k)
+        Poly poly;
+        unsigned long coef;
+        if (!to_poly(e->rhs, &loop, var, &poly, &coef) || coef != 1)
+        {
+            ok = false;
+            break;
+        }
+
+        unsigned long sum = 0;
+        for (int j = 0; j <= MAX_DEGREE; j++)
+        {
+            sum += poly.c[j] * power_sum(loop.trip, j);
+        }
+        if (sum)
+        {
+            NodeId add = new_binary(ND_ADD, new_var_node(var, node->loc), new_num(sum, node->loc), node->loc);
+            vals[i] = new_binary(ND_ASSIGN, new_var_node(var, node->loc), add, node->loc);
+        }
+    }
+
+    if (ok)
+    {
+        // 各変数の終了時の値の代入と、帰納変数の終了時の値の代入に置き換える
+        NodeId head = 0;
+        NodeId *cur = &head;
+        for (int i = 0; i < len; i++)
+        {
+            if (vals[i])
+            {
+                *cur = new_unary(ND_EXPR_STMT, vals[i], node->loc);
+                cur = &nd(*cur)->next;
+            }
+        }
+        NodeId iv = new_binary(ND_ASSIGN, new_var_node(loop.iv, node->loc), new_num(loop.final, node->loc), node->loc);
+        *cur = new_unary(ND_EXPR_STMT, iv, node->loc);
+
+        node->kind = ND_BLOCK;
+        node->body = head;
+    }
+
+    free(stmts);
+    free(vars);
+    free(vals);
+    return ok;
+}
+
+static int walk(NodeId id)
+{
+    if (!id)
+    {
+        return 0;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_IF:
+        return walk(node->then) + walk(node->els);
+    case ND_FOR:
+    {
+        // 内側のループから置き換える
+        int n = walk(node->then);
+        return n + collapse(id);
+    }
+    case ND_BLOCK:
+    {
+        int n = 0;
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            n += walk(s);
+        }
+        return n;
+    }
+    default:
+        return 0;
+    }
+}
+
+int scev(Function *prog)
+{
+    int n = 0;
+    for (NodeId s = prog->node; s; s = nd(s)->next)
+    {
+        n += walk(s);
+    }
+    return n;
+}
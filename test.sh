@@ -3,17 +3,26 @@ assert() {
     expected="$1"
     input="$2"
 
-    ./orecc "$input" > tmp.s
-    cc -o tmp tmp.s
-    ./tmp
-    actual="$?"
-
-    if [ "$actual" = "$expected" ]; then
-        echo "$input => $actual"
-    else
-        echo "$input => $expected expected, but got $actual"
-        exit 1
-    fi
+    for opt in -O0 -O1 -O2; do
+        ./orecc $opt "$input" > tmp.s
+        cc -o tmp tmp.s
+        ./tmp
+        actual="$?"
+
+        if [ "$actual" != "$expected" ]; then
+            echo "$input => $expected expected, but got $actual ($opt)"
+            exit 1
+        fi
+
+        ./orecc $opt --interp "$input"
+        actual="$?"
+        if [ "$actual" != "$expected" ]; then
+            echo "$input => $expected expected, but got $actual ($opt --interp)"
+            exit 1
+        fi
+    done
+
+    echo "$input => $actual"
 }
 
 assert 0 'return 0;'
@@ -25,6 +34,9 @@ assert 15 'return 5*(9-6);'
 assert 4 'return (3+5)/2;'
 assert 2 'return -3+5;'
 assert 13 'return +3+5*2;'
+assert 3 'return ((((((((((3))))))))));'
+assert 6 'return -(-(2*(1+2)));'
+assert 8 'return 1+2*3-4/2+8/(1+1)-(1);'
 
 assert 1 'return 3 == 3;'
 assert 0 'return 1 == 2;'
@@ -67,5 +79,156 @@ assert 55 'i=0; j=0; for (i=0; i<=10; i=i+1) j=i+j; return j;'
 assert 3 'for (;;) return 3; return 5;'
 
 assert 10 'i=0; while(i<10) i=i+1; return i;'
+assert 0 'j=0; for (i=0; i<0; i=i+1) j=j+1; return j;'
+assert 7 'i=7; while(i<5) i=i+1; return i;'
+assert 12 'j=0; for (i=0; i<3; i=i+1) for (k=0; k<4; k=k+1) j=j+1; return j;'
+assert 67 'j=0; for (i=0; i<100; i=i+1) j=j+i*i-i; return j/1000-256;'
+assert 30 'j=0; for (i=10; i>0; i=i-2) j=j+i; return j+i;'
+assert 32 'j=-3; for (i=-2; i<=4; i=i+1) j=j-i+2*i+1; return j+i+16;'
+
+assert 20 'a=2; b=3; x=a*b+1; a=4; y=a*b+1; return x+y;'
+assert 8 'a=2; b=3; x=a*b; if (x<5) a=1; else b=1; return x+a*b;'
+assert 123 'a=1; s=0; x=a*3; for (i=0; i<4; i=i+1) s=s+(a=a*2)+a*3; return s+x;'
+assert 19 'a=1; b=a*5; a=7; c=a+b; x=(y=3)+a; return c+a;'
+assert 62 't=1; s=0; for (i=0; i<5; i=i+1) s=s+(t=t*2); return s;'
+assert 12 'n=10; j=0; for (i=0; i<n; i=i+1) j=j+i/3; return j;'
+assert 93 'n=7; j=0; for (i=1; i<=n; i=i+2) j=j+i*i; return j+i;'
+assert 0 'a=5;'
+assert 5 'a=3; b=2; c=a*7/b-(8<a*2)+(2<=b)*(a==3); return c-6;'
+assert 130 'a=1; b=2; c=3; d=4; e=5; f=6; g=7; h=8; return a+b-c+d*2*e*3-f+g+h+1-2+10/5;'
+assert 6 'x=9223372036854775807; y=x+1+x; return y-x-x+5;'
+assert 32 's=0; for (i=0; i<10; i=i+1) if (i<20) s=s+i/4+(i*3)/7; else s=s+1000; if (i==10) s=s+1; if (s<0) return 99; n=s; if (n>5) s=s+n/3; return s;'
+assert 11 'a=0-7; b=a/2; for (i=0; i<5; i=i+1) b=b+i/2; return b+10;'
+
+assert 55 'fib(n) { if (n < 2) return n; return fib(n-1) + fib(n-2); } return fib(10);'
+assert 9 'f(a, b, c, d, e, g) { return a+b*2+c*3-d+e-g; } return f(1, 2, 3, 4, 5, 6);'
+assert 17 'id(x) { return x; } a=1; b=2; return a+(b+(a*(b+id(3)*id(4))));'
+assert 12 'sgn(x) { if (x < 0) return 0-1; if (x) return 1; return 0; } s=0; for (i=0-3; i<=3; i=i+1) s=s+sgn(i)*i; return s;'
+assert 1 'return f()+1; f() {}'
+assert 6 'h(x) { return x*2; } g(n) { return h(n) + f(n); } f(n) { if (n<1) return 0; return g(n-1); } return f(3);'
+assert 61 'mx(a, b) { if (a < b) return b; return a; } m=0; s=0; for (i=0; i<20; i=i+1) { x=i*7/3-i; if (x<m) x=m-x; else x=x+1; if (m<x) m=x; s=s+mx(i, 9); } return m+s-200;'
+
+# 変数以外への代入はどの最適化レベルでもエラーになる。dseやvrpだけを有効にした場合も同じ
+for opt in -O0 -O1 -O2 '-O1 -fno-pass=cse -fno-pass=vrp' '-O1 -fno-pass=cse -fno-pass=dse'; do
+    for input in '1=3; return 0;' 'a=1; b=2; a+b=3; return a;' 'f(x) { return x; } f(1)=3; return 0;'; do
+        if ./orecc $opt "$input" > tmp.s 2> tmp.err || ! grep -q 'not an lvalue' tmp.err; then
+            echo "$input => not an lvalue expected ($opt)"
+            exit 1
+        fi
+    done
+done
+echo "1=3; => not an lvalue"
+
+# ループの揃え方の指定の誤り
+for opt in -falign-loops=16:-3 -falign-loops=16: -falign-loops=12; do
+    if ./orecc $opt 'return 0;' > tmp.s 2> tmp.err || ! grep -q 'invalid loop alignment' tmp.err; then
+        echo "$opt => invalid loop alignment expected"
+        exit 1
+    fi
+done
+echo "-falign-loops=16:-3 => invalid loop alignment"
+
+# ファイルからの入力
+printf 'a = 3;\nb = 4;\nreturn a * b;\n' > tmp.in
+./orecc -f tmp.in > tmp.s
+cc -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 12 ]; then
+    echo "-f tmp.in => 12 expected, but got $actual"
+    exit 1
+fi
+echo "-f tmp.in => $actual"
+
+# DWARFの行番号情報付きのコンパイル
+./orecc -g -f tmp.in > tmp.s
+cc -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 12 ] || ! grep -q '^    .loc 1 3 1$' tmp.s; then
+    echo "-g -f tmp.in => 12 with line info expected, but got $actual"
+    exit 1
+fi
+echo "-g -f tmp.in => $actual"
+
+# 基本ブロックの実行回数の計測
+input='j=0; for (i=0; i<10; i=i+1) j=j+i/2; return j;'
+./orecc -fprofile-counters=tmp.prof "$input" > tmp.s
+cc -o tmp tmp.s
+./tmp
+expected='        11 | /*1*/j=0; for (i=0; /*11*/i<10; i=i+1) /*10*/j=j+i/2; /*1,1*/return j;'
+actual="$(./orecc --annotate=tmp.prof "$input")"
+if [ "$actual" != "$expected" ]; then
+    echo "--annotate => '$expected' expected, but got '$actual'"
+    exit 1
+fi
+echo "--annotate => $actual"
+
+input='j=0; for (i=0; i<10; i=i+1) j=j+i; return j;'
+expected='    j = (j + 45);'
+actual="$(./orecc --print-after=scev "$input" 2>&1 > /dev/null | grep -cxF "$expected")"
+if [ "$actual" != 1 ] || ./orecc -fno-pass=scev --print-after=scev "$input" 2>&1 > /dev/null | grep -q after; then
+    echo "--print-after=scev => '$expected' expected"
+    exit 1
+fi
+echo "--print-after=scev =>$expected"
+
+# 値域から非負とわかる除算は符号なしの除算やシフトにし、結果の決まる分岐を取り除く
+input='j=0; for (i=0; i<10; i=i+1) j=j+i/4+i/3; return j;'
+actual="$(./orecc "$input")"
+if ! echo "$actual" | grep -q shr || ! echo "$actual" | grep -q 'div ' || echo "$actual" | grep -q idiv ||
+    ! ./orecc -fno-pass=vrp "$input" | grep -q idiv; then
+    echo "vrp => shr and div instead of idiv expected"
+    exit 1
+fi
+input='j=0; for (i=0; i<10; i=i+1) if (i<20) j=j+i; else j=j+100; return j;'
+actual="$(./orecc --print-after=vrp "$input" 2>&1 > /dev/null)"
+if echo "$actual" | grep -q 'if (' || ! echo "$actual" | grep -qF 'j = (j + i);'; then
+    echo "--print-after=vrp => if (i < 20) folded expected"
+    exit 1
+fi
+echo "vrp => shr, div and folded branch"
+
+# 小さな関数は呼び出し元に展開する
+input='sq(x) { return x*x; } return sq(3)+1;'
+actual="$(./orecc --print-after=inline "$input" 2>&1 > /dev/null)"
+if echo "$actual" | grep -q 'sq(' || ! echo "$actual" | grep -q 'sq.return = '; then
+    echo "--print-after=inline => sq inlined expected"
+    exit 1
+fi
+echo "--print-after=inline => sq inlined"
+
+# フレームが不要な葉関数はrbpを設定しない。-O0の場合と他の関数を呼び出す場合は設定する
+input='k() { return 7; } m() { return k(); } return m();'
+prologue() {
+    ./orecc $1 -fno-pass=inline "$input" | sed -n "/^orecc.$2:/,/^  ret/p" | grep -c 'push rbp'
+}
+if [ "$(prologue -O1 k)" != 0 ] || [ "$(prologue -O0 k)" != 1 ] || [ "$(prologue -O1 m)" != 1 ]; then
+    echo "leaf prologue => push rbp only in non-leaf or -O0 functions expected"
+    exit 1
+fi
+echo "leaf prologue => no push rbp"
+
+# 小さなif文はcmovで選択する
+input='m=0; for (i=0; i<10; i=i+1) { x=i*7/3-i; if (m<x) m=x; } return m;'
+if ! ./orecc "$input" | grep -q cmov || ./orecc -fno-pass=ifcvt "$input" | grep -q cmov; then
+    echo "ifcvt => cmov expected"
+    exit 1
+fi
+echo "ifcvt => cmov"
+
+# 並列字句解析は逐次字句解析と同じ出力とエラーを返す
+for i in $(seq 20000); do echo "a=a+$i; if (a>=b) b=b*2; else c = c-1 ;"; done > tmp.in
+echo 'return a;' >> tmp.in
+for err in '' '\001'; do
+    printf "$err" >> tmp.in
+    expected="$(./orecc -f tmp.in 2>&1)"
+    actual="$(./orecc -flex-threads=4 -f tmp.in 2>&1)"
+    if [ "$actual" != "$expected" ]; then
+        echo "-flex-threads=4 -f tmp.in => same output as serial lexing expected"
+        exit 1
+    fi
+done
+echo "-flex-threads=4 -f tmp.in => $(echo "$actual" | tail -1)"
 
-echo OK
\ No newline at end of file
+echo OK
@@ -0,0 +1,83 @@
+.intel_syntax noprefix
+.global main
+.type main, @function
+main:
+  .cfi_startproc
+  push rbp
+  .cfi_def_cfa_offset 16
+  .cfi_offset rbp, -16
+  mov rbp, rsp
+  .cfi_def_cfa_register rbp
+  sub rsp, 32
+  mov [rbp-24], r12
+  .cfi_offset r12, -40
+    inc qword ptr [rip+.L.prof.counters+0]
+    mov qword ptr [rbp-16], 0
+    mov qword ptr [rbp-8], 0
+    inc qword ptr [rip+.L.prof.counters+8]
+    mov r10, qword ptr [rbp-8]
+    cmp r10, 10
+    jge .L.end.2
+    .p2align 4,,10
+.L.begin.2:
+    inc qword ptr [rip+.L.prof.counters+16]
+    mov r10, qword ptr [rbp-8]
+    shr r10, 1
+    add qword ptr [rbp-16], r10
+    add qword ptr [rbp-8], 1
+    inc qword ptr [rip+.L.prof.counters+8]
+    mov r10, qword ptr [rbp-8]
+    cmp r10, 10
+    jl .L.begin.2
+.L.end.2:
+    inc qword ptr [rip+.L.prof.counters+24]
+    inc qword ptr [rip+.L.prof.counters+32]
+    mov r10, qword ptr [rbp-16]
+    mov rax, r10
+    jmp .L.return.1
+    mov rax, 0
+.L.return.1:
+  push rax
+  mov eax, 2
+  lea rdi, [rip+.L.prof.path]
+  mov esi, 0x241
+  mov edx, 420
+  syscall
+  test rax, rax
+  js .L.prof.done
+  mov rdi, rax
+  mov eax, 1
+  lea rsi, [rip+.L.prof.table]
+  mov edx, 56
+  syscall
+  mov eax, 1
+  lea rsi, [rip+.L.prof.counters]
+  mov edx, 40
+  syscall
+  mov eax, 3
+  syscall
+.L.prof.done:
+  pop rax
+  mov r12, [rbp-24]
+  mov rsp, rbp
+  pop rbp
+  .cfi_def_cfa rsp, 8
+  ret
+  .cfi_endproc
+.size main, .-main
+  .bss
+  .align 8
+.L.prof.counters:
+  .zero 40
+  .section .rodata
+  .align 8
+.L.prof.table:
+  .ascii "ORECCPRF"
+  .quad 5
+  .quad 0
+  .quad 15
+  .quad 28
+  .quad 37
+  .quad 37
+.L.prof.path:
+  .byte 116,109,112,46,112,114,111,102,0
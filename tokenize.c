@@ -1,7 +1,11 @@
 #include "orecc.h"
+#include <pthread.h>
 
 static char *current_input;
 
+// 現在参照しているトークン列
+static TokenBuf *tokens;
+
 void error(char *fmt, ...)
 {
     va_list ap;
@@ -14,8 +18,20 @@ void error(char *fmt, ...)
 
 static void verror_at(char *loc, char *fmt, va_list ap)
 {
-    int pos = loc - current_input;
-    fprintf(stderr, "%s\n", current_input);
+    // locを含む行だけを出力する
+    char *line = loc;
+    while (current_input < line && line[-1] != '\n')
+    {
+        line--;
+    }
+    char *end = loc;
+    while (*end && *end != '\n')
+    {
+        end++;
+    }
+
+    int pos = loc - line;
+    fprintf(stderr, "%.*s\n", (int)(end - line), line);
     fprintf(stderr, "%*s", pos, ""); // pos個のスペースを出力
     fprintf(stderr, "^ ");
     vfprintf(stderr, fmt, ap);
@@ -37,43 +53,154 @@ static void error_at(char *loc, char *fmt, ...)
     verror_at(loc, fmt, ap);
 }
 
-void error_tok(Token *tok, char *fmt, ...)
+void error_tok(int tok, char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    verror_at(tok_loc(tok), fmt, ap);
+}
+
+void error_loc(int loc, char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    verror_at(tok->loc, fmt, ap);
+    verror_at(current_input + loc, fmt, ap);
+}
+
+// 各行の先頭の位置。get_line_colで初めて必要になったときに作る
+static int *line_starts;
+static int nlines;
+
+void get_line_col(int loc, int *line, int *col)
+{
+    if (!line_starts)
+    {
+        int cap = 64;
+        line_starts = malloc(sizeof(*line_starts) * cap);
+        line_starts[nlines++] = 0;
+        for (char *p = current_input; *p; p++)
+        {
+            if (*p != '\n')
+            {
+                continue;
+            }
+            if (nlines == cap)
+            {
+                cap *= 2;
+                line_starts = realloc(line_starts, sizeof(*line_starts) * cap);
+            }
+            line_starts[nlines++] = p + 1 - current_input;
+        }
+    }
+
+    // locを含む行を二分探索する
+    int lo = 0, hi = nlines - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (line_starts[mid] <= loc)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    *line = lo + 1;
+    *col = loc - line_starts[lo] + 1;
+}
+
+static void lex_token(TokenBuf *buf);
+
+/**
+ * @brief トークンのインデックスから並列配列上の位置を求める。
+ * ストリーミング時はトークンが未読であれば字句解析を進める。
+ *
+ * @param tok トークンのインデックス
+ * @return 並列配列上の位置
+ */
+static int slot(int tok)
+{
+    while (tok >= tokens->n)
+    {
+        lex_token(tokens);
+    }
+    assert(tokens->n - tok <= tokens->cap);
+    return tok & tokens->mask;
 }
 
-bool equal(Token *tok, char *op)
+TokenKind tok_kind(int tok)
 {
-    return strlen(op) == tok->len && !strncmp(tok->loc, op, tok->len);
+    return tokens->kind[slot(tok)];
 }
 
-Token *skip(Token *tok, char *op)
+char *tok_loc(int tok)
+{
+    return current_input + tokens->loc[slot(tok)];
+}
+
+int tok_offset(int tok)
+{
+    return tokens->loc[slot(tok)];
+}
+
+int tok_len(int tok)
+{
+    return tokens->len[slot(tok)];
+}
+
+long tok_val(int tok)
+{
+    return tokens->val[slot(tok)];
+}
+
+bool equal(int tok, char *op)
+{
+    int i = slot(tok);
+    int len = tokens->len[i];
+    return !strncmp(current_input + tokens->loc[i], op, len) && op[len] == '\0';
+}
+
+int skip(int tok, char *op)
 {
     if (!equal(tok, op))
     {
         error_tok(tok, "expected '%s'", op);
     }
-    return tok->next;
+    return tok + 1;
+}
+
+void set_token_buf(TokenBuf *buf)
+{
+    tokens = buf;
 }
 
 /**
- * @brief 新しくトークン構造体を生成し、生成したトークンをcurの次のトークンに追加する
+ * @brief トークン列の末尾に新しいトークンを追加する
  *
+ * @param buf トークン列
  * @param kind トークンの種別
- * @param cur 現在のトークン
  * @param str トークンの文字列
  * @param len トークン文字列の長さ
- * @return Token* 新しいトークン構造体のポインタ
+ * @return 追加したトークンの並列配列上の位置
  */
-static Token *new_token(TokenKind kind, Token *cur, char *str, int len)
+static int new_token(TokenBuf *buf, TokenKind kind, char *str, int len)
 {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind = kind;
-    tok->loc = str;
-    tok->len = len;
-    cur->next = tok;
+    if (buf->n == buf->cap && buf->mask == -1)
+    {
+        buf->cap = buf->cap ? buf->cap * 2 : 256;
+        buf->kind = realloc(buf->kind, sizeof(*buf->kind) * buf->cap);
+        buf->loc = realloc(buf->loc, sizeof(*buf->loc) * buf->cap);
+        buf->len = realloc(buf->len, sizeof(*buf->len) * buf->cap);
+        buf->val = realloc(buf->val, sizeof(*buf->val) * buf->cap);
+    }
+
+    int tok = buf->n++ & buf->mask;
+    buf->kind[tok] = kind;
+    buf->loc[tok] = str - current_input;
+    buf->len[tok] = len;
+    buf->val[tok] = 0;
     return tok;
 }
 
@@ -98,14 +225,17 @@ static bool is_alnum(char c)
     return is_alpha(c) || ('0' <= c && c <= '9');
 }
 
-static bool is_keyword(Token *tok)
+/**
+ * @brief 長さlenの文字列pが予約語か判定する
+ */
+static bool is_keyword(char *p, int len)
 {
     // Keywords
     static char *kw[] = {"return", "if", "else", "for", "while"};
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
     {
-        if (equal(tok, kw[i]))
+        if (!strncmp(p, kw[i], len) && kw[i][len] == '\0')
         {
             return true;
         }
@@ -114,78 +244,298 @@ static bool is_keyword(Token *tok)
 }
 
 /**
- * @brief TK_IDENTとして判定した予約語のトークンのkindをTK_RESERVEDに変換する
+ * @brief 空白文字でないbuf->pから始まるトークンを1つ読み、トークン列の末尾に追加する
  *
- * @param tok 先頭のトークンのポインタ
+ * @param buf トークン列
+ * @return トークンを追加した場合true。不正な文字の場合はbuf->pを進めずにfalse
  */
-static void convert_keywords(Token *tok)
+static bool scan_token(TokenBuf *buf)
 {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next)
+    char *p = buf->p;
+
+    // 数値の判定
+    if (isdigit(*p))
+    {
+        char *q = p;
+        long val = strtoul(p, &p, 10);
+        int i = new_token(buf, TK_NUM, q, p - q);
+        buf->val[i] = val;
+        buf->p = p;
+        return true;
+    }
+
+    // 変数・予約語の判定
+    if (is_alpha(*p))
     {
-        if (t->kind == TK_IDENT && is_keyword(t))
+        char *q = p++;
+        while (is_alnum(*p))
         {
-            t->kind = TK_RESERVED;
+            p++;
         }
+        new_token(buf, is_keyword(q, p - q) ? TK_RESERVED : TK_IDENT, q, p - q);
+        buf->p = p;
+        return true;
     }
+
+    // 等号・不等号
+    if (startswith(p, "==") || startswith(p, "!=") || startswith(p, "<=") || startswith(p, ">="))
+    {
+        new_token(buf, TK_RESERVED, p, 2);
+        buf->p = p + 2;
+        return true;
+    }
+
+    // 区切り文字(+-*/, <>, (), =, etc.)
+    if (ispunct(*p))
+    {
+        new_token(buf, TK_RESERVED, p, 1);
+        buf->p = p + 1;
+        return true;
+    }
+
+    return false;
 }
 
-Token *tokenize(char *p)
+/**
+ * @brief buf->pから次のトークンを1つ読み、トークン列の末尾に追加する。
+ * 入力の終端に達している場合はTK_EOFを追加する。
+ *
+ * @param buf トークン列
+ */
+static void lex_token(TokenBuf *buf)
+{
+    char *p = buf->p;
+
+    // 空白文字をスキップ
+    while (isspace(*p))
+    {
+        p++;
+    }
+    buf->p = p;
+
+    if (!*p)
+    {
+        new_token(buf, TK_EOF, p, 0);
+        return;
+    }
+
+    if (!scan_token(buf))
+    {
+        error_at(p, "invalid token");
+    }
+}
+
+TokenBuf *tokenize(char *p)
 {
     current_input = p;
-    Token head = {};
-    Token *cur = &head;
+    TokenBuf *buf = calloc(1, sizeof(TokenBuf));
+    buf->mask = -1;
+    buf->p = p;
 
-    while (*p)
+    do
     {
-        // 空白文字をスキップ
-        if (isspace(*p))
+        lex_token(buf);
+    } while (buf->kind[buf->n - 1] != TK_EOF);
+
+    tokens = buf;
+    return buf;
+}
+
+TokenBuf *lex_open(char *p)
+{
+    current_input = p;
+    TokenBuf *buf = calloc(1, sizeof(TokenBuf));
+    buf->cap = LEX_RING;
+    buf->mask = LEX_RING - 1;
+    buf->kind = calloc(LEX_RING, sizeof(*buf->kind));
+    buf->loc = calloc(LEX_RING, sizeof(*buf->loc));
+    buf->len = calloc(LEX_RING, sizeof(*buf->len));
+    buf->val = calloc(LEX_RING, sizeof(*buf->val));
+    buf->p = p;
+
+    tokens = buf;
+    return buf;
+}
+
+// 並列字句解析で1つのスレッドに割り当てる入力の最小バイト数。小さい入力はスレッドを使わない
+#define LEX_MIN_CHUNK (1 << 16)
+
+/**
+ * @brief 並列字句解析で1つのスレッドが受け持つ入力の区間
+ */
+typedef struct
+{
+    /**
+     * @brief 区間のトークン列
+     */
+    TokenBuf buf;
+
+    /**
+     * @brief 区間の終わり
+     */
+    char *end;
+
+    /**
+     * @brief 不正な文字で字句解析を止めた場合true。buf.pがその文字を指す
+     */
+    bool invalid;
+
+    /**
+     * @brief 結合したトークン列における区間の先頭のトークンの位置
+     */
+    int start;
+
+    /**
+     * @brief 結合したトークン列
+     */
+    TokenBuf *out;
+} LexChunk;
+
+/**
+ * @brief 区間を字句解析する。エラーはここでは報告せず、逐次字句解析と同じ順序で報告できるよう記録する
+ */
+static void *lex_chunk(void *arg)
+{
+    LexChunk *c = arg;
+    TokenBuf *buf = &c->buf;
+    for (;;)
+    {
+        while (buf->p < c->end && isspace(*buf->p))
         {
-            p++;
-            continue;
+            buf->p++;
         }
-
-        // 数値の判定
-        if (isdigit(*p))
+        if (buf->p >= c->end)
         {
-            cur = new_token(TK_NUM, cur, p, 0);
-            char *tmp = p;
-            cur->val = strtoul(p, &p, 10);
-            cur->len = p - tmp;
-            continue;
+            return NULL;
         }
-
-        // 変数の判定
-        if (is_alpha(*p))
+        if (!scan_token(buf))
         {
-            char *q = p++;
-            while (is_alnum(*p))
-            {
-                p++;
-            }
-            cur = new_token(TK_IDENT, cur, q, p - q);
-            cur->len = p - q;
-            continue;
+            c->invalid = true;
+            return NULL;
         }
+    }
+}
+
+/**
+ * @brief 区間のトークン列を結合したトークン列の該当位置に写す
+ */
+static void *copy_chunk(void *arg)
+{
+    LexChunk *c = arg;
+    TokenBuf *out = c->out;
+    int n = c->buf.n;
+    memcpy(out->kind + c->start, c->buf.kind, sizeof(*out->kind) * n);
+    memcpy(out->loc + c->start, c->buf.loc, sizeof(*out->loc) * n);
+    memcpy(out->len + c->start, c->buf.len, sizeof(*out->len) * n);
+    memcpy(out->val + c->start, c->buf.val, sizeof(*out->val) * n);
+    free(c->buf.kind);
+    free(c->buf.loc);
+    free(c->buf.len);
+    free(c->buf.val);
+    return NULL;
+}
 
-        // 等号・不等号
-        if (startswith(p, "==") || startswith(p, "!=") || startswith(p, "<=") || startswith(p, ">="))
+/**
+ * @brief 各区間についてfnを実行する。先頭の区間は呼び出したスレッドで実行する
+ */
+static void run_chunks(LexChunk *chunks, int n, void *(*fn)(void *))
+{
+    pthread_t *th = calloc(n, sizeof(*th));
+    for (int i = 1; i < n; i++)
+    {
+        if (pthread_create(&th[i], NULL, fn, &chunks[i]))
         {
-            cur = new_token(TK_RESERVED, cur, p, 2);
-            p += 2;
-            continue;
+            error("cannot create lexer thread");
         }
+    }
+    fn(&chunks[0]);
+    for (int i = 1; i < n; i++)
+    {
+        pthread_join(th[i], NULL);
+    }
+    free(th);
+}
+
+/**
+ * @brief 区切りの候補pから、トークンを分けない位置まで進める。
+ * 空白文字と';'はどのトークンにも含まれないため、その直前で区切ればトークンは分かれない
+ */
+static char *chunk_boundary(char *p)
+{
+    while (*p && !isspace(*p) && *p != ';')
+    {
+        p++;
+    }
+    return p;
+}
+
+TokenBuf *tokenize_parallel(char *input, int nthreads)
+{
+    current_input = input;
+    long size = strlen(input);
+    int n = nthreads < size / LEX_MIN_CHUNK ? nthreads : size / LEX_MIN_CHUNK;
+    if (n <= 1)
+    {
+        return lex_open(input);
+    }
+
+    // 区間の境界を入力の等分点からトークンの切れ目まで進めて決める
+    LexChunk *chunks = calloc(n, sizeof(LexChunk));
+    char *p = input;
+    for (int i = 0; i < n; i++)
+    {
+        LexChunk *c = &chunks[i];
+        char *end = i == n - 1 ? input + size : chunk_boundary(input + size * (i + 1) / n);
+        c->end = end < p ? p : end;
+        c->buf.mask = -1;
+        c->buf.p = p;
+        p = c->end;
+    }
+    run_chunks(chunks, n, lex_chunk);
 
-        // 区切り文字(+-*/, <>, (), =, etc.)
-        if (ispunct(*p))
+    // 不正な文字を含む最初の区間より後のトークンは使わない
+    int used = 0;
+    int total = 0;
+    while (used < n)
+    {
+        chunks[used].start = total;
+        total += chunks[used].buf.n;
+        if (chunks[used++].invalid)
         {
-            cur = new_token(TK_RESERVED, cur, p++, 1);
-            continue;
+            break;
         }
+    }
 
-        error_at(p, "invalid token");
+    TokenBuf *buf = calloc(1, sizeof(TokenBuf));
+    buf->cap = total + 1;
+    buf->mask = -1;
+    buf->kind = malloc(sizeof(*buf->kind) * buf->cap);
+    buf->loc = malloc(sizeof(*buf->loc) * buf->cap);
+    buf->len = malloc(sizeof(*buf->len) * buf->cap);
+    buf->val = malloc(sizeof(*buf->val) * buf->cap);
+    for (int i = 0; i < used; i++)
+    {
+        chunks[i].out = buf;
+    }
+    run_chunks(chunks, used, copy_chunk);
+    buf->n = total;
+
+    // 不正な文字があれば、パーサがその位置のトークンを参照したときにlex_tokenが逐次字句解析と同じエラーを報告する
+    LexChunk *last = &chunks[used - 1];
+    buf->p = last->invalid ? last->buf.p : input + size;
+    if (!last->invalid)
+    {
+        new_token(buf, TK_EOF, buf->p, 0);
+    }
+    for (int i = used; i < n; i++)
+    {
+        free(chunks[i].buf.kind);
+        free(chunks[i].buf.loc);
+        free(chunks[i].buf.len);
+        free(chunks[i].buf.val);
     }
+    free(chunks);
 
-    new_token(TK_EOF, cur, p, 0);
-    convert_keywords(head.next);
-    return head.next;
+    tokens = buf;
+    return buf;
 }
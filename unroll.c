@@ -0,0 +1,264 @@
+#include "orecc.h"
+
+// 繰り返し回数が実行時に決まるループを展開する最大の倍数
+#define MAX_FACTOR 4
+
+// 帰納変数の増分の上限。展開後の条件式で使う増分の倍数が桁あふれしないようにする
+#define MAX_STEP (1L << 20)
+
+/**
+ * @brief 変数の参照を定数に置き換える
+ */
+static void subst(NodeId id, Var *var, long val)
+{
+    if (!id)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return;
+    case ND_VAR:
+        if (node->var == var)
+        {
+            node->kind = ND_NUM;
+            node->val = val;
+        }
+        return;
+    case ND_IF:
+    case ND_FOR:
+        subst(node->init, var, val);
+        subst(node->cond, var, val);
+        subst(node->then, var, val);
+        subst(node->els, var, val);
+        subst(node->inc, var, val);
+        return;
+    case ND_BLOCK:
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            subst(s, var, val);
+        }
+        return;
+    case ND_FUNCALL:
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            subst(arg, var, val);
+        }
+        return;
+    default:
+        subst(node->lhs, var, val);
+        subst(node->rhs, var, val);
+        return;
+    }
+}
+
+/**
+ * @brief 式が参照する変数のいずれかがノード以下で代入されているか判定する
+ */
+static bool reads_assigned(NodeId expr, NodeId id)
+{
+    Node *node = nd(expr);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return false;
+    case ND_VAR:
+        return is_assigned(id, node->var);
+    default:
+        return reads_assigned(node->lhs, id) || reads_assigned(node->rhs, id);
+    }
+}
+
+/**
+ * @brief 繰り返し回数が定まるループを、帰納変数を定数に置き換えた本体の並びに展開する
+ */
+static void unroll_full(NodeId id, CountedLoop *loop)
+{
+    Node *node = nd(id);
+    NodeId head = 0;
+    NodeId *cur = &head;
+    long iv = loop->start;
+    for (unsigned long k = 0; k < loop->trip; k++)
+    {
+        *cur = copy_tree(node->then);
+        subst(*cur, loop->iv, iv);
+        cur = &nd(*cur)->next;
+        iv = (unsigned long)iv + loop->step;
+    }
+
+    // 初期化式と更新式は定数の代入のみなので、終了時の値の代入だけを残す
+    NodeId final = new_binary(ND_ASSIGN, new_var_node(loop->iv, node->loc), new_num(loop->final, node->loc), node->loc);
+    *cur = new_unary(ND_EXPR_STMT, final, node->loc);
+
+    node->kind = ND_BLOCK;
+    node->body = head;
+}
+
+/**
+ * @brief for (init; iv < bound; iv = iv + step) の形のループを、本体をfactor回並べたループと
+ * 残りの繰り返しを行う元のループに分ける。
+ * boundは本体で値が変わらない副作用のない式、stepは正の定数とする
+ *
+ * @return 展開した場合true
+ */
+static bool unroll_runtime(NodeId id, int budget)
+{
+    Node *node = nd(id);
+    if (!node->cond || !node->inc)
+    {
+        return false;
+    }
+
+    // 更新式: iv = iv + step | iv = step + iv
+    Node *inc = nd(nd(node->inc)->lhs);
+    if (inc->kind != ND_ASSIGN || nd(inc->lhs)->kind != ND_VAR)
+    {
+        return false;
+    }
+    Var *iv = nd(inc->lhs)->var;
+    Node *e = nd(inc->rhs);
+    NodeId step_id;
+    if (e->kind == ND_ADD && nd(e->lhs)->kind == ND_VAR && nd(e->lhs)->var == iv)
+    {
+        step_id = e->rhs;
+    }
+    else if (e->kind == ND_ADD && nd(e->rhs)->kind == ND_VAR && nd(e->rhs)->var == iv)
+    {
+        step_id = e->lhs;
+    }
+    else
+    {
+        return false;
+    }
+    long step = nd(step_id)->val;
+    if (nd(step_id)->kind != ND_NUM || step <= 0 || MAX_STEP < step)
+    {
+        return false;
+    }
+
+    // 条件式: iv < bound | iv <= bound
+    Node *cond = nd(node->cond);
+    if ((cond->kind != ND_LT && cond->kind != ND_LE) || nd(cond->lhs)->kind != ND_VAR || nd(cond->lhs)->var != iv)
+    {
+        return false;
+    }
+    NodeId bound = cond->rhs;
+    if (!is_pure(bound) || is_assigned(node->then, iv) || reads_assigned(bound, node->then) ||
+        reads_assigned(bound, node->inc))
+    {
+        return false;
+    }
+
+    int size = count_nodes(node->then) + count_nodes(node->inc);
+    int factor = MAX_FACTOR;
+    while (factor > 1 && size * factor > budget)
+    {
+        factor /= 2;
+    }
+    if (factor < 2)
+    {
+        return false;
+    }
+
+    // 本体をfactor回並べたループ。iv + k <= boundのときはfactor回すべて元の条件を満たす
+    int loc = node->loc;
+    long k = step * (factor - 1);
+    NodeId body = 0;
+    NodeId *cur = &body;
+    for (int i = 0; i < factor; i++)
+    {
+        *cur = copy_tree(node->then);
+        cur = &nd(*cur)->next;
+        *cur = copy_tree(node->inc);
+        cur = &nd(*cur)->next;
+    }
+    NodeId main_loop = new_node(ND_FOR, loc);
+    nd(main_loop)->then = new_node(ND_BLOCK, loc);
+    nd(nd(main_loop)->then)->body = body;
+    NodeId limit = new_binary(ND_SUB, copy_tree(bound), new_num(k, loc), loc);
+    nd(main_loop)->cond = new_binary(cond->kind, new_var_node(iv, loc), limit, loc);
+
+    // bound - kが桁あふれする場合は展開したループを実行しない
+    NodeId safe = new_binary(ND_LT, new_num((unsigned long)LONG_MIN + k - 1, loc), copy_tree(bound), loc);
+    NodeId guard = new_node(ND_IF, loc);
+    nd(guard)->cond = safe;
+    nd(guard)->then = main_loop;
+
+    // 残りの繰り返しは元のループで行う
+    NodeId rest = new_node(ND_FOR, loc);
+    *nd(rest) = *node;
+    nd(rest)->init = 0;
+    nd(rest)->next = 0;
+    nd(guard)->next = rest;
+
+    NodeId init = node->init;
+    node->kind = ND_BLOCK;
+    if (init)
+    {
+        nd(init)->next = guard;
+        node->body = init;
+    }
+    else
+    {
+        node->body = guard;
+    }
+    return true;
+}
+
+static int walk(NodeId id)
+{
+    if (!id)
+    {
+        return 0;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_IF:
+        return walk(node->then) + walk(node->els);
+    case ND_BLOCK:
+    {
+        int n = 0;
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            n += walk(s);
+        }
+        return n;
+    }
+    case ND_FOR:
+    {
+        // 内側のループから展開する
+        int n = walk(node->then);
+        int size = count_nodes(node->then);
+
+        CountedLoop loop;
+        if (counted_loop(node, &loop) && loop.trip <= (unsigned long)opt_unroll_budget / (size ? size : 1))
+        {
+            unroll_full(id, &loop);
+            return n + 1;
+        }
+        return n + unroll_runtime(id, opt_unroll_budget);
+    }
+    default:
+        return 0;
+    }
+}
+
+int unroll(Function *prog)
+{
+    if (opt_unroll_budget <= 0)
+    {
+        return 0;
+    }
+
+    int n = 0;
+    for (NodeId s = prog->node; s; s = nd(s)->next)
+    {
+        n += walk(s);
+    }
+    return n;
+}
@@ -0,0 +1,689 @@
+#include "orecc.h"
+
+/**
+ * @brief 値の範囲 [lo, hi]。範囲が分からない場合は [LONG_MIN, LONG_MAX]
+ */
+typedef struct
+{
+    long lo;
+    long hi;
+} Range;
+
+/**
+ * @brief プログラムのある地点での各変数の値の範囲
+ */
+typedef struct
+{
+    /**
+     * @brief 変数の番号を添字とする値の範囲
+     */
+    Range *vars;
+
+    /**
+     * @brief その地点に到達しうる場合true
+     */
+    bool reachable;
+} Env;
+
+static const Range full = {LONG_MIN, LONG_MAX};
+
+static int nvars;
+
+// falseの場合は解析のみ行い、プログラムを書き換えない
+static bool mutate;
+
+static int changed;
+
+static Env *new_env(void)
+{
+    Env *env = calloc(1, sizeof(Env));
+    env->vars = calloc(nvars + 1, sizeof(Range));
+    return env;
+}
+
+static void copy_env(Env *dst, Env *src)
+{
+    memcpy(dst->vars, src->vars, nvars * sizeof(Range));
+    dst->reachable = src->reachable;
+}
+
+static Env *dup_env(Env *src)
+{
+    Env *env = new_env();
+    copy_env(env, src);
+    return env;
+}
+
+static void free_env(Env *env)
+{
+    free(env->vars);
+    free(env);
+}
+
+/**
+ * @brief dstにsrcを合わせる。合流点ではどちらの経路から来た値も取りうる
+ */
+static void join(Env *dst, Env *src)
+{
+    if (!src->reachable)
+    {
+        return;
+    }
+    if (!dst->reachable)
+    {
+        copy_env(dst, src);
+        return;
+    }
+    for (int i = 0; i < nvars; i++)
+    {
+        if (src->vars[i].lo < dst->vars[i].lo)
+        {
+            dst->vars[i].lo = src->vars[i].lo;
+        }
+        if (src->vars[i].hi > dst->vars[i].hi)
+        {
+            dst->vars[i].hi = src->vars[i].hi;
+        }
+    }
+}
+
+/**
+ * @brief dstにsrcを合わせる。範囲が広がる変数は、ループが収束するよう広がる側を無限にする
+ *
+ * @return dstが変化した場合true
+ */
+static bool widen(Env *dst, Env *src)
+{
+    if (!src->reachable)
+    {
+        return false;
+    }
+
+    bool grew = false;
+    for (int i = 0; i < nvars; i++)
+    {
+        if (src->vars[i].lo < dst->vars[i].lo)
+        {
+            dst->vars[i].lo = LONG_MIN;
+            grew = true;
+        }
+        if (src->vars[i].hi > dst->vars[i].hi)
+        {
+            dst->vars[i].hi = LONG_MAX;
+            grew = true;
+        }
+    }
+    return grew;
+}
+
+/**
+ * @brief srcの範囲がすべてdstの範囲に含まれるか判定する
+ */
+static bool includes(Env *dst, Env *src)
+{
+    if (!src->reachable)
+    {
+        return true;
+    }
+    if (!dst->reachable)
+    {
+        return false;
+    }
+    for (int i = 0; i < nvars; i++)
+    {
+        if (src->vars[i].lo < dst->vars[i].lo || dst->vars[i].hi < src->vars[i].hi)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_const(Range r)
+{
+    return r.lo == r.hi;
+}
+
+static Range add_range(Range a, Range b)
+{
+    Range r;
+    if (__builtin_add_overflow(a.lo, b.lo, &r.lo) || __builtin_add_overflow(a.hi, b.hi, &r.hi))
+    {
+        return full;
+    }
+    return r;
+}
+
+static Range sub_range(Range a, Range b)
+{
+    Range r;
+    if (__builtin_sub_overflow(a.lo, b.hi, &r.lo) || __builtin_sub_overflow(a.hi, b.lo, &r.hi))
+    {
+        return full;
+    }
+    return r;
+}
+
+/**
+ * @brief 4つの端点の組み合わせの演算結果から範囲を求める。演算が範囲の各端で単調な場合に使う
+ */
+static Range corners(long v[4])
+{
+    Range r = {v[0], v[0]};
+    for (int i = 1; i < 4; i++)
+    {
+        r.lo = v[i] < r.lo ? v[i] : r.lo;
+        r.hi = v[i] > r.hi ? v[i] : r.hi;
+    }
+    return r;
+}
+
+static Range mul_range(Range a, Range b)
+{
+    long v[4];
+    if (__builtin_mul_overflow(a.lo, b.lo, &v[0]) || __builtin_mul_overflow(a.lo, b.hi, &v[1]) ||
+        __builtin_mul_overflow(a.hi, b.lo, &v[2]) || __builtin_mul_overflow(a.hi, b.hi, &v[3]))
+    {
+        return full;
+    }
+    return corners(v);
+}
+
+static Range div_range(Range a, Range b)
+{
+    // 除数が0を含む場合と、LONG_MIN / -1 の桁あふれを含む場合は範囲を求めない
+    if ((b.lo <= 0 && 0 <= b.hi) || (a.lo == LONG_MIN && b.lo <= -1 && -1 <= b.hi))
+    {
+        return full;
+    }
+    long v[4] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+    return corners(v);
+}
+
+/**
+ * @brief 比較の結果の範囲を求める。結果が決まる場合は0または1の1点になる
+ */
+static Range compare_range(NodeKind kind, Range a, Range b)
+{
+    bool always = false, never = false;
+    switch (kind)
+    {
+    case ND_EQ:
+        always = is_const(a) && is_const(b) && a.lo == b.lo;
+        never = a.hi < b.lo || b.hi < a.lo;
+        break;
+    case ND_NE:
+        always = a.hi < b.lo || b.hi < a.lo;
+        never = is_const(a) && is_const(b) && a.lo == b.lo;
+        break;
+    case ND_LT:
+        always = a.hi < b.lo;
+        never = b.hi <= a.lo;
+        break;
+    case ND_LE:
+        always = a.hi <= b.lo;
+        never = b.hi < a.lo;
+        break;
+    default:
+        error("invalid comparison");
+    }
+    return (Range){always, !never};
+}
+
+static int log2_exact(long val)
+{
+    if (val <= 0 || (val & (val - 1)))
+    {
+        return -1;
+    }
+    return __builtin_ctzl(val);
+}
+
+/**
+ * @brief 被除数が0以上で除数が正の除算を、符号なし除算に置き換える。除数が2のべき乗の定数の場合は
+ * 右シフトに置き換え、1の場合は被除数そのものに置き換える
+ */
+static void simplify_div(NodeId id, Range a, Range b)
+{
+    Node *node = nd(id);
+    if (a.lo < 0 || b.lo < 1)
+    {
+        return;
+    }
+
+    Node *rhs = nd(node->rhs);
+    int shift = rhs->kind == ND_NUM ? log2_exact(rhs->val) : -1;
+    if (shift == 0)
+    {
+        replace_node(id, node->lhs);
+    }
+    else if (shift > 0)
+    {
+        node->kind = ND_SHR;
+        rhs->val = shift;
+    }
+    else
+    {
+        node->kind = ND_UDIV;
+    }
+    changed++;
+}
+
+/**
+ * @brief 式の値の範囲を求め、式中の代入を環境に反映する。
+ * mutateがtrueの場合は、結果が決まる比較を定数に、除算をより軽い演算に置き換える
+ */
+static Range eval(NodeId id, Env *env)
+{
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_NUM:
+        return (Range){node->val, node->val};
+    case ND_VAR:
+        return env->vars[node->var->id];
+    case ND_ASSIGN:
+    {
+        Range r = eval(node->rhs, env);
+        env->vars[nd(node->lhs)->var->id] = r;
+        return r;
+    }
+    case ND_FUNCALL:
+        for (NodeId arg = node->args; arg; arg = nd(arg)->next)
+        {
+            eval(arg, env);
+        }
+        return full;
+    default:
+        break;
+    }
+
+    Range a = eval(node->lhs, env);
+    Range b = eval(node->rhs, env);
+    switch (node->kind)
+    {
+    case ND_ADD:
+        return add_range(a, b);
+    case ND_SUB:
+        return sub_range(a, b);
+    case ND_MUL:
+        return mul_range(a, b);
+    case ND_DIV:
+    {
+        Range r = div_range(a, b);
+        if (mutate)
+        {
+            simplify_div(id, a, b);
+        }
+        return r;
+    }
+    case ND_UDIV:
+        return a.lo >= 0 && b.lo >= 1 ? div_range(a, b) : full;
+    case ND_SHR:
+        return a.lo >= 0 && is_const(b) && 0 <= b.lo && b.lo < 64 ? (Range){a.lo >> b.lo, a.hi >> b.lo} : full;
+    default:
+    {
+        Range r = compare_range(node->kind, a, b);
+        if (mutate && is_const(r) && is_removable(id))
+        {
+            node->kind = ND_NUM;
+            node->val = r.lo;
+            changed++;
+        }
+        return r;
+    }
+    }
+}
+
+/**
+ * @brief 変数の範囲をrに狭める。範囲が空になる場合は到達しない
+ */
+static void narrow(NodeId id, Range r, Env *env)
+{
+    if (!id || nd(id)->kind != ND_VAR)
+    {
+        return;
+    }
+
+    Range *v = &env->vars[nd(id)->var->id];
+    v->lo = r.lo > v->lo ? r.lo : v->lo;
+    v->hi = r.hi < v->hi ? r.hi : v->hi;
+    if (v->lo > v->hi)
+    {
+        env->reachable = false;
+    }
+}
+
+/**
+ * @brief 変数の値がcと等しくないという事実から範囲を狭める。cが定数で範囲の端と等しい場合のみ、端を1つ狭められる
+ *
+ * @param v 変数の範囲。cと等しい1点ではない
+ */
+static void exclude(NodeId id, Range v, Range c, Env *env)
+{
+    if (!is_const(c))
+    {
+        return;
+    }
+    if (v.lo == c.lo)
+    {
+        narrow(id, (Range){v.lo + 1, LONG_MAX}, env);
+    }
+    else if (v.hi == c.lo)
+    {
+        narrow(id, (Range){LONG_MIN, v.hi - 1}, env);
+    }
+}
+
+/**
+ * @brief 条件式の値がtruthであるという事実から、比較される変数の範囲を狭める
+ */
+static void refine(NodeId cond, bool truth, Env *env)
+{
+    Node *node = nd(cond);
+    if (!env->reachable || !is_pure(cond))
+    {
+        return;
+    }
+
+    // 条件式の値が0かどうかの判定は、0との比較とみなす
+    NodeKind kind = node->kind;
+    NodeId lhs = node->lhs;
+    NodeId rhs = node->rhs;
+    Range a, b;
+    if (kind == ND_VAR)
+    {
+        kind = ND_NE;
+        lhs = cond;
+        rhs = 0;
+        a = env->vars[node->var->id];
+        b = (Range){0, 0};
+    }
+    else if (kind == ND_EQ || kind == ND_NE || kind == ND_LT || kind == ND_LE)
+    {
+        bool save = mutate;
+        mutate = false;
+        a = eval(lhs, env);
+        b = eval(rhs, env);
+        mutate = save;
+    }
+    else
+    {
+        return;
+    }
+
+    // 偽の場合は否定した比較に直す。!(a < b) は b <= a、!(a <= b) は b < a
+    if (!truth)
+    {
+        switch (kind)
+        {
+        case ND_EQ:
+            kind = ND_NE;
+            break;
+        case ND_NE:
+            kind = ND_EQ;
+            break;
+        default:
+        {
+            kind = kind == ND_LT ? ND_LE : ND_LT;
+            NodeId t = lhs;
+            lhs = rhs;
+            rhs = t;
+            Range r = a;
+            a = b;
+            b = r;
+            break;
+        }
+        }
+    }
+
+    switch (kind)
+    {
+    case ND_EQ:
+        narrow(lhs, b, env);
+        narrow(rhs, a, env);
+        return;
+    case ND_NE:
+        if (is_const(a) && is_const(b) && a.lo == b.lo)
+        {
+            env->reachable = false;
+            return;
+        }
+        exclude(lhs, a, b, env);
+        exclude(rhs, b, a, env);
+        return;
+    case ND_LT:
+        if (b.hi == LONG_MIN || a.lo == LONG_MAX)
+        {
+            env->reachable = false;
+            return;
+        }
+        narrow(lhs, (Range){LONG_MIN, b.hi - 1}, env);
+        narrow(rhs, (Range){a.lo + 1, LONG_MAX}, env);
+        return;
+    default:
+        narrow(lhs, (Range){LONG_MIN, b.hi}, env);
+        narrow(rhs, (Range){a.lo, LONG_MAX}, env);
+        return;
+    }
+}
+
+/**
+ * @brief 条件式の値の範囲から、条件が常に真または常に偽であるか判定する
+ *
+ * @return 常に真の場合1、常に偽の場合0、決まらない場合-1
+ */
+static int decide(Range r)
+{
+    if (r.lo > 0 || r.hi < 0)
+    {
+        return 1;
+    }
+    if (r.lo == 0 && r.hi == 0)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+static void visit_stmt(NodeId id, Env *env);
+
+/**
+ * @brief ループの本体を1回実行した後の、ループの先頭での範囲を求める
+ */
+static void visit_iter(Node *node, Env *env)
+{
+    if (node->cond)
+    {
+        eval(node->cond, env);
+        refine(node->cond, true, env);
+    }
+    visit_stmt(node->then, env);
+    if (node->inc)
+    {
+        visit_stmt(node->inc, env);
+    }
+}
+
+/**
+ * @brief ループの先頭での範囲を求める。範囲を広げて収束させた後、1回だけ本体を解析し直して狭める
+ *
+ * @param entry ループに入る時点での範囲
+ * @return ループの先頭での範囲
+ */
+static Env *loop_head(Node *node, Env *entry)
+{
+    bool save = mutate;
+    mutate = false;
+
+    Env *head = dup_env(entry);
+    Env *cur = new_env();
+    do
+    {
+        copy_env(cur, head);
+        visit_iter(node, cur);
+    } while (widen(head, cur));
+
+    // 狭めた範囲が本体の解析に対して閉じている場合のみ採用する
+    Env *narrowed = dup_env(head);
+    visit_iter(node, narrowed);
+    join(narrowed, entry);
+    copy_env(cur, narrowed);
+    visit_iter(node, cur);
+    if (includes(narrowed, cur))
+    {
+        copy_env(head, narrowed);
+    }
+
+    free_env(narrowed);
+    free_env(cur);
+    mutate = save;
+    return head;
+}
+
+/**
+ * @brief 文の実行前の範囲から、実行後の範囲を求める。
+ * mutateがtrueの場合は、結果が決まる比較と分岐を取り除く
+ *
+ * @param id 文のノード
+ * @param env 実行前の範囲。実行後の範囲で上書きする
+ */
+static void visit_stmt(NodeId id, Env *env)
+{
+    if (!env->reachable)
+    {
+        return;
+    }
+
+    Node *node = nd(id);
+    switch (node->kind)
+    {
+    case ND_RETURN:
+        eval(node->lhs, env);
+        env->reachable = false;
+        return;
+    case ND_EXPR_STMT:
+        eval(node->lhs, env);
+        return;
+    case ND_BLOCK:
+        for (NodeId s = node->body; s; s = nd(s)->next)
+        {
+            visit_stmt(s, env);
+        }
+        return;
+    case ND_IF:
+    {
+        int taken = decide(eval(node->cond, env));
+        NodeId then = node->then;
+        NodeId els = node->els;
+
+        // 結果が決まる分岐は、実行する側の文だけを残す
+        if (mutate && taken >= 0 && is_removable(node->cond))
+        {
+            node->kind = ND_BLOCK;
+            node->body = taken ? then : els;
+            changed++;
+            if (node->body)
+            {
+                visit_stmt(node->body, env);
+            }
+            return;
+        }
+
+        Env *other = dup_env(env);
+        refine(node->cond, true, env);
+        refine(node->cond, false, other);
+        if (taken == 0)
+        {
+            env->reachable = false;
+        }
+        if (taken == 1)
+        {
+            other->reachable = false;
+        }
+        visit_stmt(then, env);
+        if (els)
+        {
+            visit_stmt(els, other);
+        }
+        join(env, other);
+        free_env(other);
+        return;
+    }
+    case ND_FOR:
+    {
+        if (node->init)
+        {
+            visit_stmt(node->init, env);
+        }
+        if (!env->reachable)
+        {
+            return;
+        }
+
+        // 最初の判定で条件が偽になるループは初期化式だけを残す
+        if (mutate && node->cond && is_removable(node->cond))
+        {
+            mutate = false;
+            int taken = decide(eval(node->cond, env));
+            mutate = true;
+            if (taken == 0)
+            {
+                NodeId init = node->init;
+                node->kind = ND_BLOCK;
+                node->body = init;
+                changed++;
+                return;
+            }
+        }
+
+        Env *head = loop_head(node, env);
+        if (mutate)
+        {
+            Env *cur = dup_env(head);
+            visit_iter(node, cur);
+            free_env(cur);
+        }
+
+        // 条件がない場合は、ループを抜けずに戻るか終了する
+        copy_env(env, head);
+        if (node->cond)
+        {
+            bool save = mutate;
+            mutate = false;
+            eval(node->cond, env);
+            mutate = save;
+            refine(node->cond, false, env);
+        }
+        else
+        {
+            env->reachable = false;
+        }
+        free_env(head);
+        return;
+    }
+    default:
+        error("invalid statement");
+    }
+}
+
+int vrp(Function *prog)
+{
+    nvars = prog->locals ? prog->locals->id + 1 : 0;
+    changed = 0;
+    mutate = true;
+
+    // 変数は初期化されるまで任意の値を取りうる
+    Env *env = new_env();
+    env->reachable = true;
+    for (int i = 0; i < nvars; i++)
+    {
+        env->vars[i] = full;
+    }
+    for (NodeId s = prog->node; s; s = nd(s)->next)
+    {
+        visit_stmt(s, env);
+    }
+    free_env(env);
+    return changed;
+}